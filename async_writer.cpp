@@ -0,0 +1,349 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define ASYNC_WRITER_URING 1
+#endif
+
+const size_t ASYNC_BUFFER_SIZE = 4 << 20; // bytes of each of the two write buffers
+const size_t ASYNC_BUFFER_ALIGNMENT = 4096; // page alignment lets the kernel copy whole pages
+const unsigned ASYNC_RING_ENTRIES = 4;
+
+/// @brief File written in the background from two alternating buffers
+/// One buffer is filled while the other one is written by io_uring, or by a writer thread where io_uring is not available.
+struct async_writer {
+    int fd = -1;
+    off_t offset = 0; // file offset of the next buffer
+    char *buffers[2] = {nullptr, nullptr};
+    size_t lengths[2] = {0, 0};
+    bool in_flight[2] = {false, false};
+    off_t offsets[2] = {0, 0}; // file offsets of the buffers in flight
+    int active = 0; // buffer being filled
+    bool failed = false;
+
+    // io_uring submission and completion rings shared with the kernel
+    bool uring = false;
+    int ring_fd = -1;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    void *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    void *cqes = nullptr;
+
+    // writer thread used without io_uring
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<int> jobs; // buffers waiting for the writer thread
+    bool stopping = false;
+};
+
+
+/// @brief Write whole buffer at an offset with blocking writes
+/// @param fd file descriptor
+/// @param data bytes to write
+/// @param length number of bytes
+/// @param offset file offset
+/// @return false on error
+bool write_fully(int fd, const char *data, size_t length, off_t offset) {
+    while(length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if(written < 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+
+#ifdef ASYNC_WRITER_URING
+/// @brief Set up io_uring with raw system calls
+/// @param writer writer receiving the rings
+/// @return false when io_uring is not available
+bool setup_uring(async_writer &writer) {
+    io_uring_params params{};
+    int ring_fd = syscall(__NR_io_uring_setup, ASYNC_RING_ENTRIES, &params);
+    if(ring_fd < 0) {
+        return false;
+    }
+    writer.ring_fd = ring_fd;
+    writer.sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    writer.cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        writer.sq_ring_size = writer.cq_ring_size = std::max(writer.sq_ring_size, writer.cq_ring_size);
+    }
+    writer.sq_ring = mmap(nullptr, writer.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(writer.sq_ring == MAP_FAILED) {
+        close(ring_fd);
+        return false;
+    }
+    writer.cq_ring = writer.sq_ring;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        writer.cq_ring = mmap(nullptr, writer.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+    writer.sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+    writer.sqes = mmap(nullptr, writer.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if(writer.cq_ring == MAP_FAILED || writer.sqes == MAP_FAILED) {
+        munmap(writer.sq_ring, writer.sq_ring_size);
+        close(ring_fd);
+        return false;
+    }
+
+    auto *sq = static_cast<char *>(writer.sq_ring);
+    auto *cq = static_cast<char *>(writer.cq_ring);
+    writer.sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    writer.sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    writer.sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    writer.sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    writer.cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    writer.cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    writer.cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    writer.cqes = cq + params.cq_off.cqes;
+    writer.uring = true;
+    return true;
+}
+
+
+/// @brief Release io_uring rings
+/// @param writer writer with rings
+void teardown_uring(async_writer &writer) {
+    munmap(writer.sqes, writer.sqes_size);
+    if(writer.cq_ring != writer.sq_ring) {
+        munmap(writer.cq_ring, writer.cq_ring_size);
+    }
+    munmap(writer.sq_ring, writer.sq_ring_size);
+    close(writer.ring_fd);
+}
+
+
+/// @brief Queue write of a buffer on the submission ring
+/// @param writer writer with rings
+/// @param buffer index of the buffer
+/// @param offset file offset
+void submit_uring(async_writer &writer, int buffer, off_t offset) {
+    unsigned tail = __atomic_load_n(writer.sq_tail, __ATOMIC_ACQUIRE);
+    unsigned index = tail & *writer.sq_mask;
+    auto *sqe = static_cast<io_uring_sqe *>(writer.sqes) + index;
+    std::memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = writer.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(writer.buffers[buffer]);
+    sqe->len = writer.lengths[buffer];
+    sqe->off = offset;
+    sqe->user_data = (static_cast<uint64_t>(offset) << 1) | buffer;
+    writer.sq_array[index] = index;
+    __atomic_store_n(writer.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if(syscall(__NR_io_uring_enter, writer.ring_fd, 1, 0, 0, nullptr, 0) < 0) {
+        // an entry the kernel took completes as usual, one it did not take is withdrawn and written here
+        if(__atomic_load_n(writer.sq_head, __ATOMIC_ACQUIRE) == tail) {
+            __atomic_store_n(writer.sq_tail, tail, __ATOMIC_RELEASE);
+            writer.failed = !write_fully(writer.fd, writer.buffers[buffer], writer.lengths[buffer], offset) || writer.failed;
+            writer.in_flight[buffer] = false;
+        }
+    }
+}
+
+
+/// @brief Wait for the next completion and finish short writes synchronously
+/// When waiting fails for another reason than a signal, the writer is marked as failed and the buffers in flight
+/// are written synchronously, so callers waiting for them return.
+/// @param writer writer with rings
+void reap_uring(async_writer &writer) {
+    unsigned head = __atomic_load_n(writer.cq_head, __ATOMIC_RELAXED);
+    while(head == __atomic_load_n(writer.cq_tail, __ATOMIC_ACQUIRE)) {
+        if(syscall(__NR_io_uring_enter, writer.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+            writer.failed = true;
+            for(int buffer = 0; buffer < 2; buffer++) {
+                if(writer.in_flight[buffer]) {
+                    write_fully(writer.fd, writer.buffers[buffer], writer.lengths[buffer], writer.offsets[buffer]);
+                    writer.in_flight[buffer] = false;
+                }
+            }
+            return;
+        }
+    }
+    const auto &cqe = static_cast<io_uring_cqe *>(writer.cqes)[head & *writer.cq_mask];
+    int buffer = cqe.user_data & 1;
+    off_t offset = cqe.user_data >> 1;
+    int result = cqe.res;
+    __atomic_store_n(writer.cq_head, head + 1, __ATOMIC_RELEASE);
+
+    size_t done = result > 0 ? result : 0;
+    if(result < 0 || done < writer.lengths[buffer]) {
+        writer.failed = !write_fully(writer.fd, writer.buffers[buffer] + done, writer.lengths[buffer] - done, offset + done) || writer.failed;
+    }
+    writer.in_flight[buffer] = false;
+}
+#endif
+
+
+/// @brief Write buffers handed over by the writer until it stops
+/// @param writer writer without io_uring
+void run_writer_thread(async_writer &writer) {
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    off_t offset = 0;
+    for(;;) {
+        writer.changed.wait(lock, [&writer]() { return writer.stopping || !writer.jobs.empty(); });
+        if(writer.jobs.empty()) {
+            return;
+        }
+        int buffer = writer.jobs.front();
+        lock.unlock();
+        bool ok = write_fully(writer.fd, writer.buffers[buffer], writer.lengths[buffer], offset);
+        offset += writer.lengths[buffer];
+        lock.lock();
+        writer.failed = !ok || writer.failed;
+        writer.jobs.pop_front();
+        writer.in_flight[buffer] = false;
+        writer.changed.notify_all();
+    }
+}
+
+
+/// @brief Open file for asynchronous writing, truncating it
+/// @param writer writer to open
+/// @param path path to the file
+/// @param use_uring try io_uring before the writer thread
+/// @return false when the file cannot be opened or the buffers cannot be allocated
+bool open_async_writer(async_writer &writer, const std::string &path, bool use_uring = true) {
+    writer.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(writer.fd < 0) {
+        return false;
+    }
+    for(auto &buffer : writer.buffers) {
+        buffer = static_cast<char *>(std::aligned_alloc(ASYNC_BUFFER_ALIGNMENT, ASYNC_BUFFER_SIZE));
+    }
+    if(writer.buffers[0] == nullptr || writer.buffers[1] == nullptr) {
+        for(auto &buffer : writer.buffers) {
+            std::free(buffer);
+            buffer = nullptr;
+        }
+        close(writer.fd);
+        writer.fd = -1;
+        return false;
+    }
+#ifdef ASYNC_WRITER_URING
+    if(use_uring && setup_uring(writer)) {
+        return true;
+    }
+#endif
+    writer.thread = std::thread(run_writer_thread, std::ref(writer));
+    return true;
+}
+
+
+/// @brief Wait until a buffer is written
+/// @param writer open writer
+/// @param buffer index of the buffer
+void wait_for_buffer(async_writer &writer, int buffer) {
+#ifdef ASYNC_WRITER_URING
+    if(writer.uring) {
+        while(writer.in_flight[buffer]) {
+            reap_uring(writer);
+        }
+        return;
+    }
+#endif
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.changed.wait(lock, [&writer, buffer]() { return !writer.in_flight[buffer]; });
+}
+
+
+/// @brief Start writing the active buffer and continue filling the other one
+/// @param writer open writer
+void submit_active_buffer(async_writer &writer) {
+    int buffer = writer.active;
+    if(writer.lengths[buffer] > 0) {
+        writer.in_flight[buffer] = true;
+        writer.offsets[buffer] = writer.offset;
+#ifdef ASYNC_WRITER_URING
+        if(writer.uring) {
+            submit_uring(writer, buffer, writer.offset);
+        }
+        else
+#endif
+        {
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            writer.jobs.push_back(buffer);
+            writer.changed.notify_all();
+        }
+        writer.offset += writer.lengths[buffer];
+    }
+    writer.active = 1 - buffer;
+    wait_for_buffer(writer, writer.active);
+    writer.lengths[writer.active] = 0;
+}
+
+
+/// @brief Append bytes, returns as soon as they are copied to a buffer
+/// @param writer open writer
+/// @param data bytes to append
+/// @param length number of bytes
+void async_write(async_writer &writer, const char *data, size_t length) {
+    while(length > 0) {
+        size_t &used = writer.lengths[writer.active];
+        size_t part = std::min(length, ASYNC_BUFFER_SIZE - used);
+        std::memcpy(writer.buffers[writer.active] + used, data, part);
+        used += part;
+        data += part;
+        length -= part;
+        if(used == ASYNC_BUFFER_SIZE) {
+            submit_active_buffer(writer);
+        }
+    }
+}
+
+
+/// @brief Write remaining bytes, wait for all writes and close the file
+/// @param writer open writer
+/// @return false when any write failed
+bool close_async_writer(async_writer &writer) {
+    submit_active_buffer(writer);
+    wait_for_buffer(writer, 1 - writer.active);
+#ifdef ASYNC_WRITER_URING
+    if(writer.uring) {
+        teardown_uring(writer);
+    }
+#endif
+    if(writer.thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            writer.stopping = true;
+            writer.changed.notify_all();
+        }
+        writer.thread.join();
+    }
+    for(auto &buffer : writer.buffers) {
+        std::free(buffer);
+        buffer = nullptr;
+    }
+    bool ok = close(writer.fd) == 0 && !writer.failed;
+    writer.fd = -1;
+    return ok;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+const float SEA_LEVEL_TEMPERATURE = 288.15; // ISA, in Kelvin
+const float SEA_LEVEL_PRESSURE = 101325.0; // ISA, in Pascal
+const float TEMPERATURE_LAPSE_RATE = 0.0065; // K/m in troposphere
+const float TROPOPAUSE_ALTITUDE = 11000.0;
+const float AIR_GAS_CONSTANT = 287.05; // specific gas constant of dry air, J/(kg K)
+const float ISA_GRAVITY = 9.80665;
+const float CELSIUS_TO_KELVIN = 273.15;
+const float AIR_HEAT_CAPACITY_RATIO = 1.4;
+const float ATMOSPHERE_TABLE_STEP = 10.0; // spacing of the density table in meters
+const float ATMOSPHERE_TABLE_MIN = -1000.0; // lowest height of the table relative to the origin
+const float ATMOSPHERE_TABLE_MAX = 20000.0; // highest height of the table relative to the origin
+
+/// @brief Air density and speed of sound in a table of heights, heights are y coordinates of the simulation
+struct atmosphere {
+    float min_height;
+    float step;
+    std::vector<float> density;
+    std::vector<float> speed_of_sound;
+};
+
+
+/// @brief Temperature at altitude given by International Standard Atmosphere scaled to local conditions
+/// @param altitude altitude above sea level in meters
+/// @param base_altitude altitude of the reference conditions above sea level
+/// @param base_temperature temperature at the reference altitude in Kelvin
+/// @return temperature in Kelvin
+float get_isa_temperature(float altitude, float base_altitude, float base_temperature) {
+    return base_temperature - TEMPERATURE_LAPSE_RATE*(std::min(altitude, TROPOPAUSE_ALTITUDE) - base_altitude);
+}
+
+
+/// @brief Air density at altitude given by International Standard Atmosphere scaled to local conditions
+/// @param altitude altitude above sea level in meters
+/// @param base_altitude altitude of the reference conditions above sea level
+/// @param base_temperature temperature at the reference altitude in Kelvin
+/// @param base_pressure pressure at the reference altitude in Pascal
+/// @return air density in kg/m^3
+float get_isa_density(float altitude, float base_altitude, float base_temperature, float base_pressure) {
+    const float exponent = ISA_GRAVITY/(AIR_GAS_CONSTANT*TEMPERATURE_LAPSE_RATE);
+    // troposphere, temperature falls linearly with altitude
+    float temperature = get_isa_temperature(altitude, base_altitude, base_temperature);
+    float pressure = base_pressure*std::pow(temperature/base_temperature, exponent);
+    // stratosphere, temperature is constant and pressure falls exponentially
+    if(altitude > TROPOPAUSE_ALTITUDE) {
+        pressure *= std::exp(-ISA_GRAVITY*(altitude - TROPOPAUSE_ALTITUDE)/(AIR_GAS_CONSTANT*temperature));
+    }
+    return pressure/(AIR_GAS_CONSTANT*temperature);
+}
+
+
+/// @brief Precompute air density for heights of the simulation
+/// @param altitude altitude of the origin above sea level in meters
+/// @param temperature temperature at the origin in degrees Celsius
+/// @param pressure pressure at the origin in Pascal
+/// @return atmosphere table
+atmosphere create_atmosphere(float altitude, float temperature, float pressure) {
+    atmosphere air{ATMOSPHERE_TABLE_MIN, ATMOSPHERE_TABLE_STEP, {}, {}};
+    int size = static_cast<int>((ATMOSPHERE_TABLE_MAX - ATMOSPHERE_TABLE_MIN)/ATMOSPHERE_TABLE_STEP) + 1;
+    for(int i = 0; i < size; i++) {
+        float height = air.min_height + i*air.step;
+        air.density.push_back(get_isa_density(altitude + height, altitude, temperature + CELSIUS_TO_KELVIN, pressure));
+        float local_temperature = get_isa_temperature(altitude + height, altitude, temperature + CELSIUS_TO_KELVIN);
+        air.speed_of_sound.push_back(std::sqrt(AIR_HEAT_CAPACITY_RATIO*AIR_GAS_CONSTANT*local_temperature));
+    }
+    return air;
+}
+
+
+/// @brief Standard atmosphere with the origin at sea level
+/// @return atmosphere table
+atmosphere create_standard_atmosphere() {
+    return create_atmosphere(0.0f, SEA_LEVEL_TEMPERATURE - CELSIUS_TO_KELVIN, SEA_LEVEL_PRESSURE);
+}
+
+
+/// @brief Value at a height, linearly interpolated from a table of the atmosphere
+/// @param air atmosphere table
+/// @param values density or speed of sound column of the table
+/// @param height y coordinate in meters
+/// @return interpolated value
+inline float sample_atmosphere(const atmosphere &air, const std::vector<float> &values, float height) {
+    float index = std::clamp((height - air.min_height)/air.step, 0.0f, static_cast<float>(values.size() - 2));
+    int i = static_cast<int>(index);
+    float fraction = index - i;
+    return values[i] + (values[i + 1] - values[i])*fraction;
+}
+
+
+/// @brief Air density at a height
+/// @param air atmosphere table
+/// @param height y coordinate in meters
+/// @return air density in kg/m^3
+inline float get_air_density(const atmosphere &air, float height) {
+    return sample_atmosphere(air, air.density, height);
+}
+
+
+/// @brief Speed of sound at a height
+/// @param air atmosphere table
+/// @param height y coordinate in meters
+/// @return speed of sound in m/s
+inline float get_speed_of_sound(const atmosphere &air, float height) {
+    return sample_atmosphere(air, air.speed_of_sound, height);
+}
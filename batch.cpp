@@ -0,0 +1,332 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <map>
+#include <cstdint>
+#include <tuple>
+#include <stdexcept>
+
+#include "json/json.hpp"
+#include "json_output.cpp"
+
+const size_t PIPELINE_QUEUE_SIZE = 256; // scenarios waiting between two stages of the pipeline, power of two
+const size_t REORDER_WINDOW = 1024; // most scenarios solved ahead of the oldest one not written yet
+
+/// @brief Scenario with the shared defaults filled in
+/// @param defaults shared defaults
+/// @param scenario keys of the scenario, nested objects are merged key by key
+/// @return complete scenario
+nlohmann::json apply_defaults(const nlohmann::json &defaults, const nlohmann::json &scenario) {
+    nlohmann::json merged = defaults;
+    merged.update(scenario, true);
+    return merged;
+}
+
+
+/// @brief Read scenarios of a batch one by one and hand each of them over with the defaults filled in
+/// A JSON batch is {"defaults": {...}, "scenarios": [...]} or a plain array of scenarios. It is parsed with a callback
+/// that hands every finished scenario over and drops it from the document, so a large batch is never held in memory.
+/// Defaults have to come before the scenarios. An NDJSON batch has one object per line, a line with a "defaults" key
+/// sets the defaults of the lines after it. A line that is not a JSON object is handed to on_error in place of its
+/// scenario and reading goes on with the next line.
+/// @param in input stream
+/// @param ndjson input has one JSON object per line
+/// @param consumer called for every scenario in input order
+/// @param on_error called with the reason for every NDJSON line that cannot be read, reading stops with the
+/// exception of the parser when empty
+void read_scenarios(std::istream &in, bool ndjson, const std::function<void(nlohmann::json)> &consumer,
+                    const std::function<void(const std::string &)> &on_error = nullptr) {
+    using json = nlohmann::json;
+    json defaults = json::object();
+
+    if(ndjson) {
+        std::string line;
+        while(std::getline(in, line)) {
+            if(line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            json scenario;
+            try {
+                scenario = json::parse(line);
+                if(!scenario.is_object()) {
+                    throw std::runtime_error("scenario is not a JSON object");
+                }
+            }
+            catch(const std::exception &e) {
+                if(!on_error) {
+                    throw;
+                }
+                on_error(e.what());
+                continue;
+            }
+            if(scenario.contains("defaults")) {
+                defaults = scenario["defaults"];
+                continue;
+            }
+            consumer(apply_defaults(defaults, scenario));
+        }
+        return;
+    }
+
+    // depth of scenario objects, 1 in a plain array and 2 in the scenarios array of a document
+    int scenario_depth = 0;
+    std::string key;
+    json::parser_callback_t callback = [&](int depth, json::parse_event_t event, json &parsed) {
+        if(depth == 0 && event == json::parse_event_t::array_start) {
+            scenario_depth = 1;
+        }
+        else if(depth == 0 && event == json::parse_event_t::object_start) {
+            scenario_depth = 2;
+        }
+        else if(depth == 1 && event == json::parse_event_t::key) {
+            key = parsed;
+        }
+        else if(depth == 1 && scenario_depth == 2 && key == "defaults" && event == json::parse_event_t::object_end) {
+            defaults = parsed;
+        }
+        else if(depth == scenario_depth && event == json::parse_event_t::object_end && (scenario_depth == 1 || key == "scenarios")) {
+            consumer(apply_defaults(defaults, parsed));
+            return false;
+        }
+        return true;
+    };
+    // only defaults and empty arrays are left of the document
+    std::ignore = json::parse(in, callback);
+}
+
+
+/// @brief Bounded lock-free queue for many producers and consumers
+/// Every cell carries a sequence number telling whether it is free for the producer or full for the consumer of a position,
+/// so producers and consumers only compete on their own position counter.
+template<typename T>
+struct bounded_queue {
+    struct cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // next position to push to
+    alignas(64) std::atomic<size_t> tail{0}; // next position to pop from
+    alignas(64) std::atomic<uint32_t> pushes{0}; // changes on every push, stages waiting for a value wait on it
+    alignas(64) std::atomic<uint32_t> pops{0}; // changes on every pop, stages waiting for room wait on it
+
+    /// @param capacity number of cells, power of two
+    explicit bounded_queue(size_t capacity) : cells(new cell[capacity]), mask(capacity - 1) {
+        for(size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+};
+
+
+/// @brief Push value unless the queue is full
+/// @param queue bounded queue
+/// @param value value moved into the queue on success
+/// @return false when the queue is full
+template<typename T>
+bool try_push(bounded_queue<T> &queue, T &value) {
+    size_t pos = queue.head.load(std::memory_order_relaxed);
+    typename bounded_queue<T>::cell *c;
+    for(;;) {
+        c = &queue.cells[pos & queue.mask];
+        intptr_t difference = static_cast<intptr_t>(c->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+        if(difference == 0 && queue.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+        }
+        if(difference < 0) {
+            return false;
+        }
+        if(difference > 0) {
+            pos = queue.head.load(std::memory_order_relaxed);
+        }
+    }
+    c->value = std::move(value);
+    c->sequence.store(pos + 1, std::memory_order_release);
+    queue.pushes.fetch_add(1, std::memory_order_release);
+    queue.pushes.notify_all();
+    return true;
+}
+
+
+/// @brief Pop value unless the queue is empty
+/// @param queue bounded queue
+/// @param value receives the oldest value
+/// @return false when the queue is empty
+template<typename T>
+bool try_pop(bounded_queue<T> &queue, T &value) {
+    size_t pos = queue.tail.load(std::memory_order_relaxed);
+    typename bounded_queue<T>::cell *c;
+    for(;;) {
+        c = &queue.cells[pos & queue.mask];
+        intptr_t difference = static_cast<intptr_t>(c->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1);
+        if(difference == 0 && queue.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+        }
+        if(difference < 0) {
+            return false;
+        }
+        if(difference > 0) {
+            pos = queue.tail.load(std::memory_order_relaxed);
+        }
+    }
+    value = std::move(c->value);
+    c->sequence.store(pos + queue.mask + 1, std::memory_order_release);
+    queue.pops.fetch_add(1, std::memory_order_release);
+    queue.pops.notify_all();
+    return true;
+}
+
+
+/// @brief Push value, blocking while the queue is full
+/// @param queue bounded queue
+/// @param value value moved into the queue
+template<typename T>
+void push(bounded_queue<T> &queue, T &value) {
+    for(;;) {
+        // a pop after reading the counter changes it, so the wait cannot miss the room it makes
+        uint32_t pops = queue.pops.load(std::memory_order_acquire);
+        if(try_push(queue, value)) {
+            return;
+        }
+        queue.pops.wait(pops, std::memory_order_acquire);
+    }
+}
+
+
+/// @brief Wake stages waiting for a value, so they see a change of state other than a push
+/// @param queue bounded queue
+template<typename T>
+void wake_consumers(bounded_queue<T> &queue) {
+    queue.pushes.fetch_add(1, std::memory_order_release);
+    queue.pushes.notify_all();
+}
+
+
+/// @brief Scenario or result passed between stages of the pipeline
+struct pipeline_item {
+    size_t index;
+    nlohmann::json data;
+    bool failed = false; // data is already the error result of a line that could not be read
+    int precision = -1; // significant digits of the numbers of the result, negative for the shortest text
+};
+
+
+/// @brief Read, solve and write a batch with every stage on its own threads
+/// A parser thread streams scenarios into a bounded queue, solver threads take them and put results into a second
+/// queue, and the calling thread writes results in input order, keeping results that arrive early in a reorder buffer.
+/// Solvers stay within a window of the oldest unwritten result, so the reorder buffer stays bounded as well.
+/// An NDJSON line that cannot be read becomes the result {"error": ..., "index": ...} without being solved, the
+/// lines after it are solved as usual. The "output_precision" of a scenario, or of its defaults, applies to its result.
+/// @param in batch input
+/// @param ndjson input has one JSON object per line
+/// @param out buffer receiving one JSON line per result, flushed on return
+/// @param solve solves a scenario given its index
+/// @param threads number of solver threads, 0 uses all hardware threads
+/// @return number of scenarios, including the lines that could not be read
+/// @throws the error of the parser when a JSON document cannot be read, after the results before it are written
+size_t run_pipeline(std::istream &in, bool ndjson, output_buffer &out, const std::function<nlohmann::json(nlohmann::json, size_t)> &solve, int threads = 0) {
+    if(threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    bounded_queue<pipeline_item> scenarios(PIPELINE_QUEUE_SIZE);
+    bounded_queue<pipeline_item> results(PIPELINE_QUEUE_SIZE);
+    std::atomic<bool> parsed{false};
+    std::atomic<size_t> total{0};
+    std::atomic<size_t> written{0};
+    std::exception_ptr parse_error;
+
+    std::thread parser([&]() {
+        size_t index = 0;
+        try {
+            read_scenarios(in, ndjson, [&](nlohmann::json scenario) {
+                pipeline_item item{index++, std::move(scenario)};
+                push(scenarios, item);
+            }, [&](const std::string &error) {
+                pipeline_item item{index, {{"error", error}, {"index", index}}, true};
+                index++;
+                push(scenarios, item);
+            });
+        }
+        catch(...) {
+            parse_error = std::current_exception();
+        }
+        total = index;
+        parsed = true;
+        wake_consumers(scenarios);
+        wake_consumers(results);
+    });
+
+    auto solver = [&]() {
+        pipeline_item item;
+        for(;;) {
+            uint32_t pushes = scenarios.pushes.load(std::memory_order_acquire);
+            bool finished = parsed;
+            if(!try_pop(scenarios, item)) {
+                // queue is drained only after the parser has finished
+                if(finished) {
+                    return;
+                }
+                scenarios.pushes.wait(pushes, std::memory_order_acquire);
+                continue;
+            }
+            for(size_t oldest = written; item.index >= oldest + REORDER_WINDOW; oldest = written) {
+                written.wait(oldest);
+            }
+            if(!item.failed) {
+                try {
+                    item.precision = read_output_precision(item.data);
+                }
+                catch(const nlohmann::json::exception &e) {
+                    item = {item.index, {{"error", e.what()}, {"index", item.index}}, true};
+                }
+            }
+            if(!item.failed) {
+                item.data = solve(std::move(item.data), item.index);
+            }
+            push(results, item);
+        }
+    };
+    std::vector<std::thread> pool;
+    for(int i = 0; i < threads; i++) {
+        pool.emplace_back(solver);
+    }
+
+    // write results in input order
+    std::map<size_t, pipeline_item> reorder;
+    pipeline_item item;
+    for(;;) {
+        uint32_t pushes = results.pushes.load(std::memory_order_acquire);
+        if(parsed && written == total) {
+            break;
+        }
+        if(!try_pop(results, item)) {
+            results.pushes.wait(pushes, std::memory_order_acquire);
+            continue;
+        }
+        reorder.emplace(item.index, std::move(item));
+        for(auto next = reorder.begin(); next != reorder.end() && next->first == written; next = reorder.erase(next)) {
+            out.precision = next->second.precision;
+            write_json(out, next->second.data);
+            write_char(out, '\n');
+            written++;
+        }
+        written.notify_all();
+    }
+
+    flush_buffer(out);
+    parser.join();
+    for(auto &thread : pool) {
+        thread.join();
+    }
+    if(parse_error) {
+        std::rethrow_exception(parse_error);
+    }
+    return total;
+}
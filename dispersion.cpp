@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <array>
+
+#include "simulation.cpp"
+
+const int DISPERSION_BATCH_SIZE = 4096; // bullets simulated together in one registry
+const int UNCERTAIN_PARAMETERS = 4; // velocity, mass, elevation, azimuth
+const float UNSCENTED_ALPHA = 1.0; // spread of sigma points
+const float UNSCENTED_BETA = 2.0; // optimal for normal distribution
+const float UNSCENTED_KAPPA = 0.0;
+
+/// @brief Standard deviations of the shot parameters
+struct dispersion_model {
+    float velocity_sd; // muzzle velocity in m/s
+    float mass_sd; // bullet mass in kg
+    float elevation_sd; // aim jitter in radians
+    float azimuth_sd; // aim jitter in radians
+    float density_sd; // relative air density
+};
+
+/// @brief Statistics of impacts in the vertical plane of the target
+struct dispersion_result {
+    int shots;
+    float hit_probability;
+    float cep; // circular error probable, radius containing half of the impacts
+    float mean_lateral; // mean offset to the right of the target
+    float mean_vertical; // mean offset above the target
+    float sd_lateral;
+    float sd_vertical;
+    float covariance;
+};
+
+/// @brief Offset of a position from the target in the vertical plane of the target
+struct target_offset {
+    float lateral;
+    float vertical;
+};
+
+/// @brief Covariance of velocity in m/s, mass in kg, elevation and azimuth in radians
+using parameter_covariance = std::array<std::array<float, UNCERTAIN_PARAMETERS>, UNCERTAIN_PARAMETERS>;
+
+/// @brief Mean and covariance of impacts in the vertical plane of the target
+struct uncertainty_result {
+    target_offset mean;
+    float var_lateral;
+    float var_vertical;
+    float covariance;
+    float ellipse_major; // semi axes of the one sigma ellipse
+    float ellipse_minor;
+    float ellipse_angle; // angle of the major axis from the lateral direction in radians
+};
+
+
+/// @brief Counter based random numbers, every number depends only on the seed and its counter
+/// so results do not depend on which thread draws them or in what order.
+/// @param seed seed of the random sequence
+/// @param counter index of the number in the sequence
+/// @return 64 random bits
+uint64_t random_bits(uint64_t seed, uint64_t counter) {
+    // splitmix64 finalizer applied to the counter mixed with the seed
+    uint64_t z = seed + (counter + 1)*0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/// @brief Standard normal random number from the counter based sequence using Box-Muller transform
+/// @param seed seed of the random sequence
+/// @param counter index of the number in the sequence
+/// @return normally distributed number with zero mean and unit deviation
+float random_normal(uint64_t seed, uint64_t counter) {
+    uint64_t bits = random_bits(seed, counter);
+    // two uniform numbers in (0, 1] from the upper and lower half of the bits
+    double u1 = ((bits >> 32) + 1.0)/4294967296.0;
+    double u2 = ((bits & 0xffffffffULL) + 1.0)/4294967296.0;
+    return static_cast<float>(std::sqrt(-2.0*std::log(u1))*std::cos(2.0*3.14159265358979323846*u2));
+}
+
+
+/// @brief Offset of a position from the target in the vertical plane of the target
+/// @param pos position in the plane of the target
+/// @param start starting position
+/// @param target target position
+/// @return lateral and vertical offset
+target_offset get_target_offset(position pos, position start, position target) {
+    float dx = target.x - start.x;
+    float dz = target.z - start.z;
+    float dh = sqrt(dx*dx + dz*dz);
+    // right hand side of the direction to the target
+    float lateral = ((pos.x - target.x)*(-dz) + (pos.z - target.z)*dx)/dh;
+    return {lateral, pos.y - target.y};
+}
+
+
+/// @brief Velocity vector rotated by elevation and azimuth and scaled by speed change
+/// @param vel velocity vector
+/// @param speed_change change of speed in m/s
+/// @param elevation_change change of elevation in radians
+/// @param azimuth_change change of azimuth in radians
+/// @return perturbed velocity
+velocity perturb_velocity(velocity vel, float speed_change, float elevation_change, float azimuth_change) {
+    float speed = sqrt(vel.dx*vel.dx + vel.dy*vel.dy + vel.dz*vel.dz) + speed_change;
+    float elevation = get_launch_angle(vel) + elevation_change;
+    float azimuth = atan2(vel.dz, vel.dx) + azimuth_change;
+    float horizontal = speed*std::cos(elevation);
+    return {horizontal*std::cos(azimuth), speed*std::sin(elevation), horizontal*std::sin(azimuth)};
+}
+
+
+/// @brief Initial conditions of one perturbed shot
+/// @param start starting position
+/// @param target target position
+/// @param vel velocity of the firing solution
+/// @param bullet_mass mass of the bullet
+/// @param model standard deviations of the shot parameters
+/// @param seed seed of the random sequence
+/// @param index index of the shot
+/// @param drag drag coefficient of the bullet depending on Mach number
+/// @return launch of the shot
+launch perturb_launch(position start, position target, velocity vel, float bullet_mass, const dispersion_model &model, uint64_t seed, uint64_t index,
+                      const drag_table *drag = nullptr) {
+    // every shot owns five consecutive random numbers
+    uint64_t counter = index*5;
+    float speed_change = model.velocity_sd*random_normal(seed, counter);
+    float mass_change = model.mass_sd*random_normal(seed, counter + 1);
+    float elevation_change = model.elevation_sd*random_normal(seed, counter + 2);
+    float azimuth_change = model.azimuth_sd*random_normal(seed, counter + 3);
+    float density_factor = std::max(1.0f + model.density_sd*random_normal(seed, counter + 4), 0.01f);
+    // mass and air density enter the equations only through drag, as their ratio
+    float drag_mass = (bullet_mass + mass_change)/density_factor;
+    return {start, target, perturb_velocity(vel, speed_change, elevation_change, azimuth_change), drag_mass, nullptr, nullptr, 0.0f, drag};
+}
+
+
+/// @brief Run perturbed shots of a firing solution and evaluate their impacts in the plane of the target
+/// Shots are simulated in batches, batches are distributed over threads. Each shot draws its own
+/// random numbers from a counter based generator, so results are the same for any number of threads.
+/// @param start starting position
+/// @param target target position
+/// @param vel velocity of the firing solution
+/// @param bullet_mass mass of the bullet
+/// @param dt time step in seconds
+/// @param model standard deviations of the shot parameters
+/// @param target_radius radius of the target in meters
+/// @param shots number of shots
+/// @param seed seed of the random sequence
+/// @param threads number of threads, 0 uses all hardware threads
+/// @param env air around the bullets
+/// @param drag drag coefficient of the bullet depending on Mach number
+/// @return statistics of the impacts
+dispersion_result run_monte_carlo(position start, position target, velocity vel, float bullet_mass, float dt, const dispersion_model &model,
+                                  float target_radius, int shots, uint64_t seed, int threads = 0, const environment &env = {}, const drag_table *drag = nullptr) {
+    if(threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    simulation_limits limits = get_default_limits(start, target);
+    std::vector<target_offset> offsets(shots);
+    int batches = (shots + DISPERSION_BATCH_SIZE - 1)/DISPERSION_BATCH_SIZE;
+    std::atomic<int> next_batch{0};
+
+    auto worker = [&]() {
+        std::vector<launch> launches;
+        for(int batch = next_batch++; batch < batches; batch = next_batch++) {
+            int first = batch*DISPERSION_BATCH_SIZE;
+            int last = std::min(first + DISPERSION_BATCH_SIZE, shots);
+            launches.clear();
+            for(int i = first; i < last; i++) {
+                launches.push_back(perturb_launch(start, target, vel, bullet_mass, model, seed, i, drag));
+            }
+            auto results = simulate_batch(launches, dt, limits, env);
+            for(int i = first; i < last; i++) {
+                const auto &result = results[i - first];
+                position reached = result.closest;
+                if(result.reason != termination_reason::passed_target) {
+                    reached = extrapolate_to_target(result.impact, result.impact_velocity, start, target);
+                }
+                offsets[i] = get_target_offset(reached, start, target);
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for(int i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(auto &thread : pool) {
+        thread.join();
+    }
+
+    // statistics are summed in shot order, independent of the threads
+    dispersion_result result{shots, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    if(shots == 0) {
+        return result;
+    }
+    double sum_lateral = 0, sum_vertical = 0;
+    int hits = 0;
+    std::vector<float> radii;
+    radii.reserve(shots);
+    for(const auto &offset : offsets) {
+        sum_lateral += offset.lateral;
+        sum_vertical += offset.vertical;
+        float radius = sqrt(offset.lateral*offset.lateral + offset.vertical*offset.vertical);
+        hits += radius <= target_radius;
+        radii.push_back(radius);
+    }
+    double mean_lateral = sum_lateral/shots;
+    double mean_vertical = sum_vertical/shots;
+    double var_lateral = 0, var_vertical = 0, covariance = 0;
+    for(const auto &offset : offsets) {
+        var_lateral += (offset.lateral - mean_lateral)*(offset.lateral - mean_lateral);
+        var_vertical += (offset.vertical - mean_vertical)*(offset.vertical - mean_vertical);
+        covariance += (offset.lateral - mean_lateral)*(offset.vertical - mean_vertical);
+    }
+    std::nth_element(radii.begin(), radii.begin() + shots/2, radii.end());
+
+    result.hit_probability = static_cast<float>(hits)/shots;
+    result.cep = radii[shots/2];
+    result.mean_lateral = mean_lateral;
+    result.mean_vertical = mean_vertical;
+    result.sd_lateral = std::sqrt(var_lateral/shots);
+    result.sd_vertical = std::sqrt(var_vertical/shots);
+    result.covariance = covariance/shots;
+    return result;
+}
+
+
+/// @brief Lower triangular Cholesky factor of a symmetric positive semidefinite matrix
+/// @param matrix symmetric matrix
+/// @return factor L with L*L^T equal to the matrix
+parameter_covariance cholesky(const parameter_covariance &matrix) {
+    parameter_covariance factor{};
+    for(int i = 0; i < UNCERTAIN_PARAMETERS; i++) {
+        for(int j = 0; j <= i; j++) {
+            float sum = matrix[i][j];
+            for(int k = 0; k < j; k++) {
+                sum -= factor[i][k]*factor[j][k];
+            }
+            if(i == j) {
+                // zero variance leaves the column empty
+                factor[i][i] = sqrt(std::max(sum, 0.0f));
+            }
+            else if(factor[j][j] > 0) {
+                factor[i][j] = sum/factor[j][j];
+            }
+        }
+    }
+    return factor;
+}
+
+
+/// @brief Propagate mean and covariance of shot parameters to the impact with the unscented transform
+/// The 2n+1 sigma points are simulated together as one batch, which gives the dispersion
+/// at the cost of a few simulations instead of a Monte Carlo ensemble.
+/// @param start starting position
+/// @param target target position
+/// @param vel velocity of the firing solution, the mean of velocity and angles
+/// @param bullet_mass mean mass of the bullet
+/// @param dt time step in seconds
+/// @param covariance covariance of velocity, mass, elevation and azimuth
+/// @param env air around the bullets
+/// @param drag drag coefficient of the bullet depending on Mach number
+/// @return mean and covariance of the impacts
+uncertainty_result propagate_uncertainty(position start, position target, velocity vel, float bullet_mass, float dt, const parameter_covariance &covariance,
+                                         const environment &env = {}, const drag_table *drag = nullptr) {
+    const int n = UNCERTAIN_PARAMETERS;
+    float lambda = UNSCENTED_ALPHA*UNSCENTED_ALPHA*(n + UNSCENTED_KAPPA) - n;
+    parameter_covariance scaled;
+    for(int i = 0; i < n; i++) {
+        for(int j = 0; j < n; j++) {
+            scaled[i][j] = (n + lambda)*covariance[i][j];
+        }
+    }
+    parameter_covariance factor = cholesky(scaled);
+
+    // sigma points are the mean and the mean moved by the columns of the factor
+    std::vector<std::array<float, UNCERTAIN_PARAMETERS>> deltas(2*n + 1, std::array<float, UNCERTAIN_PARAMETERS>{});
+    for(int i = 0; i < n; i++) {
+        for(int j = 0; j < n; j++) {
+            deltas[1 + i][j] = factor[j][i];
+            deltas[1 + n + i][j] = -factor[j][i];
+        }
+    }
+    std::vector<launch> launches;
+    for(const auto &d : deltas) {
+        launches.push_back({start, target, perturb_velocity(vel, d[0], d[2], d[3]), bullet_mass + d[1], nullptr, nullptr, 0.0f, drag});
+    }
+    auto results = simulate_batch(launches, dt, get_default_limits(start, target), env);
+
+    std::vector<target_offset> offsets;
+    for(const auto &result : results) {
+        position reached = result.closest;
+        if(result.reason != termination_reason::passed_target) {
+            reached = extrapolate_to_target(result.impact, result.impact_velocity, start, target);
+        }
+        offsets.push_back(get_target_offset(reached, start, target));
+    }
+
+    // weights of the mean and of the covariance
+    std::vector<float> weight_mean(2*n + 1, 1.0f/(2*(n + lambda)));
+    std::vector<float> weight_covariance = weight_mean;
+    weight_mean[0] = lambda/(n + lambda);
+    weight_covariance[0] = weight_mean[0] + 1 - UNSCENTED_ALPHA*UNSCENTED_ALPHA + UNSCENTED_BETA;
+
+    uncertainty_result result{};
+    for(int i = 0; i < 2*n + 1; i++) {
+        result.mean.lateral += weight_mean[i]*offsets[i].lateral;
+        result.mean.vertical += weight_mean[i]*offsets[i].vertical;
+    }
+    for(int i = 0; i < 2*n + 1; i++) {
+        float dl = offsets[i].lateral - result.mean.lateral;
+        float dv = offsets[i].vertical - result.mean.vertical;
+        result.var_lateral += weight_covariance[i]*dl*dl;
+        result.var_vertical += weight_covariance[i]*dv*dv;
+        result.covariance += weight_covariance[i]*dl*dv;
+    }
+
+    // eigen decomposition of the 2x2 covariance
+    float mean_variance = (result.var_lateral + result.var_vertical)/2;
+    float spread = sqrt(std::pow((result.var_lateral - result.var_vertical)/2, 2.0f) + result.covariance*result.covariance);
+    result.ellipse_major = sqrt(std::max(mean_variance + spread, 0.0f));
+    result.ellipse_minor = sqrt(std::max(mean_variance - spread, 0.0f));
+    result.ellipse_angle = 0.5f*atan2(2*result.covariance, result.var_lateral - result.var_vertical);
+    return result;
+}
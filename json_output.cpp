@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "json/json.hpp"
+#include "output.cpp"
+
+/// @brief Read significant digits of output numbers, more digits than a double has are not meaningful
+/// @param input_data input json
+/// @return significant digits, negative for the shortest round trip text
+int read_output_precision(const nlohmann::json &input_data) {
+    return std::min(input_data.value("output_precision", -1), std::numeric_limits<double>::max_digits10);
+}
+
+
+/// @brief Append JSON string with quotes and escapes
+/// @param buffer output buffer
+/// @param text string to append
+void write_json_string(output_buffer &buffer, const std::string &text) {
+    write_char(buffer, '"');
+    for(char c : text) {
+        switch(c) {
+            case '"': write_text(buffer, "\\\""); break;
+            case '\\': write_text(buffer, "\\\\"); break;
+            case '\n': write_text(buffer, "\\n"); break;
+            case '\r': write_text(buffer, "\\r"); break;
+            case '\t': write_text(buffer, "\\t"); break;
+            default:
+                if(static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    write_text(buffer, escaped);
+                }
+                else {
+                    write_char(buffer, c);
+                }
+        }
+    }
+    write_char(buffer, '"');
+}
+
+
+/// @brief Append line break and indentation
+/// @param buffer output buffer
+/// @param indent spaces per level, negative for compact output
+/// @param depth nesting level
+inline void write_json_indent(output_buffer &buffer, int indent, int depth) {
+    if(indent >= 0) {
+        write_char(buffer, '\n');
+        for(int i = 0; i < indent*depth; i++) {
+            write_char(buffer, ' ');
+        }
+    }
+}
+
+
+/// @brief Append floating point number, numbers without fraction keep ".0" to stay floating point for readers
+/// @param buffer output buffer
+/// @param value number to append
+template<typename Float>
+void write_json_float(output_buffer &buffer, Float value) {
+    char text[MAX_NUMBER_LENGTH];
+    std::string_view formatted(text, format_number(text, value, buffer.precision));
+    write_text(buffer, formatted);
+    if(formatted.find_first_of(".e") == std::string_view::npos) {
+        write_text(buffer, ".0");
+    }
+}
+
+
+/// @brief Append JSON value laid out like nlohmann::json::dump, numbers are formatted with std::to_chars
+/// Simulation results are floats stored as doubles, they are written as floats so the text is as short as the value.
+/// @param buffer output buffer
+/// @param value JSON value
+/// @param indent spaces per level, negative for a single line
+/// @param depth nesting level of the value
+void write_json(output_buffer &buffer, const nlohmann::json &value, int indent = -1, int depth = 0) {
+    using json = nlohmann::json;
+    switch(value.type()) {
+        case json::value_t::object:
+        case json::value_t::array: {
+            bool object = value.is_object();
+            if(value.empty()) {
+                write_text(buffer, object ? "{}" : "[]");
+                return;
+            }
+            write_char(buffer, object ? '{' : '[');
+            bool first = true;
+            for(auto it = value.begin(); it != value.end(); ++it) {
+                if(!first) {
+                    write_char(buffer, ',');
+                }
+                first = false;
+                write_json_indent(buffer, indent, depth + 1);
+                if(object) {
+                    write_json_string(buffer, it.key());
+                    write_text(buffer, indent >= 0 ? ": " : ":");
+                }
+                write_json(buffer, *it, indent, depth + 1);
+            }
+            write_json_indent(buffer, indent, depth);
+            write_char(buffer, object ? '}' : ']');
+            return;
+        }
+        case json::value_t::string:
+            write_json_string(buffer, value.get_ref<const std::string &>());
+            return;
+        case json::value_t::boolean:
+            write_text(buffer, value.get<bool>() ? "true" : "false");
+            return;
+        case json::value_t::number_integer:
+            write_number(buffer, value.get<int64_t>());
+            return;
+        case json::value_t::number_unsigned:
+            write_number(buffer, value.get<uint64_t>());
+            return;
+        case json::value_t::number_float: {
+            double number = value.get<double>();
+            if(!std::isfinite(number)) {
+                write_text(buffer, "null");
+            }
+            else if(static_cast<double>(static_cast<float>(number)) == number) {
+                write_json_float(buffer, static_cast<float>(number));
+            }
+            else {
+                write_json_float(buffer, number);
+            }
+            return;
+        }
+        default:
+            write_text(buffer, "null");
+    }
+}
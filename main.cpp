@@ -2,10 +2,17 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <string>
+#include <filesystem>
 
 #include "json/json.hpp"
 #include "entt/entt.hpp"
 #include "simulation.cpp"
+#include "dispersion.cpp"
+#include "tracking.cpp"
+#include "sweep.cpp"
+#include "batch.cpp"
+#include "trajectory_store.cpp"
 
 
 void to_json(nlohmann::json_abi_v3_11_3::json& j, const position& pos)
@@ -13,19 +20,108 @@ void to_json(nlohmann::json_abi_v3_11_3::json& j, const position& pos)
     j = nlohmann::json_abi_v3_11_3::json{pos.x, pos.y, pos.z};
 }
 
-int main(int argc, char *argv[]) {
 
-    using json = nlohmann::json;
+/// @brief Read air around the bullets from the input
+/// @param input_data input json
+/// @param air storage for the atmosphere table
+/// @param wind storage for the wind field
+/// @return environment pointing to the storages that were filled
+environment read_environment(const nlohmann::json &input_data, atmosphere &air, wind_field &wind) {
+    environment env;
+    // air density changing with height, given by conditions at the origin
+    if(input_data.contains("atmosphere")) {
+        const auto &a = input_data["atmosphere"];
+        air = create_atmosphere(a.value("altitude", 0.0f), a.value("temperature", SEA_LEVEL_TEMPERATURE - CELSIUS_TO_KELVIN), a.value("pressure", SEA_LEVEL_PRESSURE));
+        env.air = &air;
+    }
 
-    if(argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " input.json output.json" << std::endl;
-        return 1;
+    // wind on a grid loaded from a binary file
+    if(input_data.contains("wind")) {
+        wind = load_wind_field(input_data["wind"]);
+        env.wind = &wind;
     }
+    return env;
+}
 
-    std::ifstream f(argv[1]);
+
+/// @brief Read drag curve of the bullet from the input, standard G1 or G7 curve or (Mach, Cd) pairs
+/// @param input_data input json
+/// @param drag storage for the drag table
+/// @return drag table or nullptr for a constant drag coefficient
+const drag_table *read_drag(const nlohmann::json &input_data, drag_table &drag) {
+    if(!input_data.contains("drag")) {
+        return nullptr;
+    }
+    float form_factor = input_data.value("form_factor", 1.0f);
+    const auto &d = input_data["drag"];
+    if(d == "G1") {
+        drag = create_drag_table(G1_DRAG, form_factor);
+    }
+    else if(d == "G7") {
+        drag = create_drag_table(G7_DRAG, form_factor);
+    }
+    else {
+        drag = create_drag_table(d.get<std::vector<std::pair<float, float>>>(), form_factor);
+    }
+    return &drag;
+}
+
+
+/// @brief Write range table for a grid of elevations and velocities, CSV or binary for a .bin output
+/// @param input_path path to the sweep settings
+/// @param output_path path to the range table
+/// @return exit code
+int sweep(const std::string &input_path, const std::string &output_path) {
+    using json = nlohmann::json;
+
+    std::ifstream f(input_path);
     json input_data = json::parse(f);
-    
-    float dt = input_data["step"];
+
+    position start{0.0f, 0.0f, 0.0f};
+    if(input_data.contains("start")) {
+        start = {input_data["start"][0], input_data["start"][1], input_data["start"][2]};
+    }
+    const auto &e = input_data["elevation"];
+    const auto &v = input_data["velocity"];
+    sweep_grid grid{
+        e["min"], e["max"], e["step"],
+        v["min"], v["max"], v["step"]
+    };
+
+    atmosphere air;
+    wind_field wind;
+    drag_table drag;
+    environment env = read_environment(input_data, air, wind);
+    const drag_table *drag_model = read_drag(input_data, drag);
+
+    auto table = run_sweep(start, grid, input_data["mass"], input_data["step"], input_data.value("threads", 0), env, drag_model);
+    int precision = read_output_precision(input_data);
+    bool binary = output_path.size() >= 4 && output_path.compare(output_path.size() - 4, 4, ".bin") == 0;
+    std::ofstream o(output_path, binary ? std::ios::binary : std::ios::out);
+    if(binary) {
+        write_range_table_binary(o, table);
+    }
+    else {
+        write_range_table_csv(o, table, precision);
+    }
+    size_t shots = get_sweep_values(grid.elevation_min, grid.elevation_max, grid.elevation_step).size()*get_sweep_values(grid.velocity_min, grid.velocity_max, grid.velocity_step).size();
+    std::cerr << "Range table: " << table.size() << " shots";
+    if(table.size() < shots) {
+        std::cerr << ", " << shots - table.size() << " shots did not land within " << MAX_ITERATIONS << " steps";
+    }
+    std::cerr << std::endl;
+    return 0;
+}
+
+
+/// @brief Solve firing solutions of one scenario
+/// @param input_data scenario
+/// @param log stream to report shots to, nullptr for no report
+/// @param cache time steps chosen for an accuracy, shared by the scenarios of a batch
+/// @return output of the scenario
+nlohmann::json solve_scenario(nlohmann::json input_data, std::ostream *log, time_step_cache *cache = nullptr) {
+    using json = nlohmann::json;
+
     position target{40.0f, 0.0f, 45.0f};
     target.x = input_data["target"][0];
     target.y = input_data["target"][1];
@@ -38,30 +134,314 @@ int main(int argc, char *argv[]) {
     start.z = input_data["start"][2];
     float bullet_mass = input_data["mass"];
 
-    position aim = target;
+    atmosphere air;
+    wind_field wind;
+    drag_table drag;
+    environment env = read_environment(input_data, air, wind);
+    const drag_table *drag_model = read_drag(input_data, drag);
+
+    // time step is either given or chosen to meet the required accuracy
+    float dt;
+    if(input_data.contains("accuracy")) {
+        dt = choose_time_step(start, target, velocity_init, bullet_mass, input_data["accuracy"], cache, env, drag_model);
+        if(log != nullptr) {
+            *log << "Chosen step: " << dt << " s" << std::endl;
+        }
+    }
+    else {
+        dt = input_data["step"];
+    }
+
+    solver_options options = get_default_options(start, target, dt);
+    options.env = env;
+    options.drag = drag_model;
+    if(input_data.contains("stages")) {
+        options.stages.clear();
+        for(const auto &stage : input_data["stages"]) {
+            options.stages.push_back({stage["step"], stage["shots"]});
+        }
+    }
+
+    if(input_data.contains("floor")) {
+        options.limits.floor = input_data["floor"];
+    }
+    if(input_data.contains("max_time")) {
+        options.limits.max_time = input_data["max_time"];
+    }
+    if(input_data.contains("bounds")) {
+        options.limits.bounds_min = {input_data["bounds"][0][0], input_data["bounds"][0][1], input_data["bounds"][0][2]};
+        options.limits.bounds_max = {input_data["bounds"][1][0], input_data["bounds"][1][1], input_data["bounds"][1][2]};
+    }
+    options.curve_tolerance = input_data.value("curve_tolerance", 0.0f);
+    // state is always float, compensated summation keeps the rounding errors of the steps
+    std::string precision = input_data.value("precision", std::string("single"));
+    if(precision != "single" && precision != "compensated") {
+        throw std::runtime_error("unknown precision " + precision + ", expected single or compensated");
+    }
+    options.compensated = precision == "compensated";
+    options.fan_lanes = input_data.value("fan_lanes", 0);
+
+    // target moving with constant velocity and acceleration, solutions lead it by the time of flight
+    target_motion motion{target, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+    if(input_data.contains("target_velocity") || input_data.contains("target_acceleration")) {
+        if(input_data.contains("target_velocity")) {
+            motion.vel = {input_data["target_velocity"][0], input_data["target_velocity"][1], input_data["target_velocity"][2]};
+        }
+        if(input_data.contains("target_acceleration")) {
+            motion.acc = {input_data["target_acceleration"][0], input_data["target_acceleration"][1], input_data["target_acceleration"][2]};
+        }
+        options.motion = &motion;
+    }
 
     json output_data;
     output_data["start"] = {start.x, start.y, start.z};
     output_data["target"] = {target.x, target.y, target.z};
     
+    // summary mode records no history and accumulates only scalars of the shots
+    bool summary_only = input_data.value("summary", false);
     std::vector<std::vector<position>> curves;
-    
-    velocity vel;
-    for(int i = 0; i < MAX_SHOTS; i++) {
-        std::vector<position> curve;
-        vel = aim_with_gravity(start, aim, velocity_init);
-        position closest_position = simulate(start, aim, dt, bullet_mass, vel, &curve);
-        curves.push_back(curve);
-        // correct aim based on closest position
-        float correction_y = target.y - closest_position.y;
-        aim.y += correction_y;
-        float min_distance = get_distance(closest_position, target);
-        std::cerr << "Shot " << i << " min distance: " << min_distance << " m\tlaunch angle: " << get_launch_angle(vel)*RADIAN_TO_DEGREE << "°" << std::endl;
-    }
-
-    output_data["curves"] = curves;
-    output_data["angle"] = get_launch_angle(vel)*RADIAN_TO_DEGREE;
-
-    std::ofstream o(argv[2]);
-    o << output_data.dump(4) << std::endl;
+    std::vector<event> events;
+    if(!summary_only) {
+        events.push_back(apex_event());
+    }
+    options.curves = summary_only ? nullptr : &curves;
+
+    // trajectories written to a file are encoded as soon as they are complete and spilled to disk beyond a memory budget
+    bool to_file = !summary_only && input_data.contains("curves_file");
+    trajectory_store store(static_cast<size_t>(input_data.value("history_budget", DEFAULT_HISTORY_BUDGET/(1 << 20)))*(1 << 20), input_data.value("spill_directory", ""));
+    if(to_file) {
+        float resolution = input_data.value("curve_resolution", DEFAULT_CURVE_RESOLUTION);
+        int order = input_data.value("curve_delta_order", 2);
+        check_curve_encoding(resolution, order);
+        options.curve_sink = [&store, resolution, order](std::vector<position> &&curve) {
+            add_curve(store, encode_curve(curve, resolution, order));
+            std::vector<position>().swap(curve);
+        };
+    }
+    options.log = log;
+    options.events = &events;
+    auto solutions = solve_firing_solutions(start, target, velocity_init, bullet_mass, options);
+
+    json solutions_data = json::array();
+    for(const auto &solution : solutions) {
+        json events_data = json::array();
+        for(const auto &record : solution.events) {
+            events_data.push_back({
+                {"name", events[record.event].name},
+                {"time", record.time},
+                {"position", record.pos}
+            });
+        }
+        json solution_data = {
+            {"arc", get_arc_name(solution.arc)},
+            {"angle", get_launch_angle(solution.vel)*RADIAN_TO_DEGREE},
+            {"time_of_flight", solution.time_of_flight},
+            {"min_distance", solution.min_distance},
+            {"stopped", get_termination_name(solution.reason)},
+            {"apex", solution.summary.apex},
+            {"impact_velocity", {solution.summary.impact_velocity.dx, solution.summary.impact_velocity.dy, solution.summary.impact_velocity.dz}},
+            {"impact_energy", solution.summary.impact_energy},
+            {"events", events_data}
+        };
+        if(options.motion != nullptr) {
+            solution_data["intercept"] = solution.target;
+        }
+
+        // dispersion of perturbed shots around the solution
+        if(input_data.contains("monte_carlo")) {
+            const auto &mc = input_data["monte_carlo"];
+            dispersion_model model{
+                mc.value("velocity_sd", 0.0f),
+                mc.value("mass_sd", 0.0f),
+                mc.value("elevation_sd", 0.0f)*DEGREE_TO_RADIAN,
+                mc.value("azimuth_sd", 0.0f)*DEGREE_TO_RADIAN,
+                mc.value("density_sd", 0.0f)
+            };
+            auto dispersion = run_monte_carlo(start, solution.target, solution.vel, bullet_mass, options.stages.back().dt, model,
+                                              mc.value("target_radius", 0.1f), mc.value("shots", 1000), mc.value("seed", 1), mc.value("threads", 0), env, drag_model);
+            solution_data["dispersion"] = {
+                {"shots", dispersion.shots},
+                {"hit_probability", dispersion.hit_probability},
+                {"cep", dispersion.cep},
+                {"mean", {dispersion.mean_lateral, dispersion.mean_vertical}},
+                {"sd", {dispersion.sd_lateral, dispersion.sd_vertical}},
+                {"covariance", dispersion.covariance}
+            };
+        }
+
+        // dispersion estimated from sigma points of the parameter covariance
+        if(input_data.contains("uncertainty")) {
+            const auto &u = input_data["uncertainty"];
+            parameter_covariance covariance{};
+            if(u.contains("covariance")) {
+                for(int i = 0; i < UNCERTAIN_PARAMETERS; i++) {
+                    for(int j = 0; j < UNCERTAIN_PARAMETERS; j++) {
+                        covariance[i][j] = u["covariance"][i][j];
+                    }
+                }
+            }
+            else {
+                float sd[] = {u.value("velocity_sd", 0.0f), u.value("mass_sd", 0.0f), u.value("elevation_sd", 0.0f)*DEGREE_TO_RADIAN, u.value("azimuth_sd", 0.0f)*DEGREE_TO_RADIAN};
+                for(int i = 0; i < UNCERTAIN_PARAMETERS; i++) {
+                    covariance[i][i] = sd[i]*sd[i];
+                }
+            }
+            auto uncertainty = propagate_uncertainty(start, solution.target, solution.vel, bullet_mass, options.stages.back().dt, covariance, env, drag_model);
+            solution_data["uncertainty"] = {
+                {"mean", {uncertainty.mean.lateral, uncertainty.mean.vertical}},
+                {"covariance", {{uncertainty.var_lateral, uncertainty.covariance}, {uncertainty.covariance, uncertainty.var_vertical}}},
+                {"ellipse", {
+                    {"major", uncertainty.ellipse_major},
+                    {"minor", uncertainty.ellipse_minor},
+                    {"angle", uncertainty.ellipse_angle*RADIAN_TO_DEGREE}
+                }}
+            };
+        }
+        solutions_data.push_back(solution_data);
+    }
+
+    // target positions of a tracking sensor, every update starts from the previous solution
+    if(input_data.contains("track")) {
+        tracker t = create_tracker(start, velocity_init, bullet_mass, options, trajectory_arc::direct, input_data.value("track_tolerance", 0.05f));
+        t.options.log = nullptr;
+        json track_data = json::array();
+        for(const auto &p : input_data["track"]) {
+            position tracked{p[0], p[1], p[2]};
+            auto update = update_tracker(t, tracked);
+            track_data.push_back({
+                {"target", tracked},
+                {"angle", get_launch_angle(update.vel)*RADIAN_TO_DEGREE},
+                {"min_distance", update.min_distance},
+                {"shots", update.shots}
+            });
+        }
+        output_data["track"] = track_data;
+    }
+
+    if(to_file) {
+        std::string curves_path = input_data["curves_file"];
+        std::ofstream curves_file(curves_path, std::ios::binary);
+        write_stored_curves(curves_file, store);
+        close_trajectory_store(store);
+        curves_file.close();
+        if(!curves_file) {
+            throw std::runtime_error("cannot write " + curves_path);
+        }
+        output_data["curves_file"] = curves_path;
+    }
+    else {
+        output_data["curves"] = curves;
+    }
+    output_data["angle"] = get_launch_angle(solutions[0].vel)*RADIAN_TO_DEGREE;
+    output_data["solutions"] = solutions_data;
+    return output_data;
+}
+
+
+/// @brief Solve all scenarios of a batch file, results are written as one JSON line per scenario in input order
+/// Reading, solving and writing run on separate threads connected by bounded queues.
+/// @param input_path path to the batch, NDJSON for .ndjson and .jsonl files
+/// @param output_path path to the results
+/// @return exit code
+int batch(const std::string &input_path, const std::string &output_path) {
+    using json = nlohmann::json;
+
+    auto ends_with = [&input_path](const std::string &suffix) {
+        return input_path.size() >= suffix.size() && input_path.compare(input_path.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    bool ndjson = ends_with(".ndjson") || ends_with(".jsonl");
+
+    std::ifstream f(input_path);
+    async_writer writer;
+    if(!open_async_writer(writer, output_path)) {
+        std::cerr << "Cannot open " << output_path << std::endl;
+        return 1;
+    }
+    output_buffer buffer = create_output_buffer(writer);
+    time_step_cache cache;
+    size_t solved = 0;
+    std::string parse_error;
+    try {
+        solved = run_pipeline(f, ndjson, buffer, [&cache](json scenario, size_t index) {
+            json result;
+            // every scenario writes its own trajectory file, curves.traj becomes curves-<index>.traj
+            if(scenario.contains("curves_file")) {
+                std::filesystem::path path = scenario["curves_file"].get<std::string>();
+                path.replace_filename(path.stem().string() + "-" + std::to_string(index) + path.extension().string());
+                scenario["curves_file"] = path.string();
+            }
+            // scenarios already run on all threads, a Monte Carlo run of one scenario stays on its thread
+            if(scenario.contains("monte_carlo") && !scenario["monte_carlo"].contains("threads")) {
+                scenario["monte_carlo"]["threads"] = 1;
+            }
+            try {
+                result = solve_scenario(std::move(scenario), nullptr, &cache);
+            }
+            catch(const std::exception &e) {
+                result = {{"error", e.what()}};
+            }
+            result["index"] = index;
+            return result;
+        });
+    }
+    catch(const std::exception &e) {
+        // results solved before the input broke off are kept
+        parse_error = e.what();
+        flush_buffer(buffer);
+    }
+    if(!close_async_writer(writer)) {
+        std::cerr << "Cannot write " << output_path << std::endl;
+        return 1;
+    }
+    if(!parse_error.empty()) {
+        std::cerr << "Cannot read " << input_path << ": " << parse_error << std::endl;
+        return 1;
+    }
+    std::cerr << "Solved " << solved << " scenarios" << std::endl;
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+    using json = nlohmann::json;
+
+    if(argc == 4 && std::string(argv[1]) == "sweep") {
+        return sweep(argv[2], argv[3]);
+    }
+    if(argc == 4 && std::string(argv[1]) == "batch") {
+        return batch(argv[2], argv[3]);
+    }
+    if(argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " input.json output.json" << std::endl;
+        std::cerr << "       " << argv[0] << " sweep sweep.json table.csv|table.bin" << std::endl;
+        std::cerr << "       " << argv[0] << " batch scenarios.json|scenarios.ndjson results.ndjson" << std::endl;
+        return 1;
+    }
+
+    std::ifstream f(argv[1]);
+    json input_data = json::parse(f);
+    int precision = read_output_precision(input_data);
+    json output_data;
+    try {
+        output_data = solve_scenario(std::move(input_data), &std::cerr);
+    }
+    catch(const std::exception &e) {
+        std::cerr << "Cannot solve " << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    async_writer writer;
+    if(!open_async_writer(writer, argv[2])) {
+        std::cerr << "Cannot open " << argv[2] << std::endl;
+        return 1;
+    }
+    output_buffer buffer = create_output_buffer(writer, precision);
+    write_json(buffer, output_data, 4);
+    write_char(buffer, '\n');
+    flush_buffer(buffer);
+    if(!close_async_writer(writer)) {
+        std::cerr << "Cannot write " << argv[2] << std::endl;
+        return 1;
+    }
 }
\ No newline at end of file
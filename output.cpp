@@ -0,0 +1,142 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "async_writer.cpp"
+
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20; // bytes collected before they are written to the stream
+const size_t MAX_NUMBER_LENGTH = 64; // longest formatted number
+
+/// @brief Text collected in a large buffer and written to a stream or an asynchronous writer in big blocks
+struct output_buffer {
+    std::ostream *out;
+    async_writer *writer = nullptr; // used instead of the stream when set
+    std::vector<char> data;
+    size_t used = 0;
+    int precision = -1; // significant digits of floats, negative for the shortest text that reads back the same value
+};
+
+
+/// @brief Create output buffer for a stream
+/// @param out stream receiving the text
+/// @param precision significant digits of floats, negative for the shortest round trip text
+/// @param size bytes collected before they are written, at least MAX_NUMBER_LENGTH
+/// @return output buffer
+output_buffer create_output_buffer(std::ostream &out, int precision = -1, size_t size = OUTPUT_BUFFER_SIZE) {
+    return {&out, nullptr, std::vector<char>(size), 0, precision};
+}
+
+
+/// @brief Create output buffer for an asynchronous writer
+/// @param writer open writer receiving the text
+/// @param precision significant digits of floats, negative for the shortest round trip text
+/// @param size bytes collected before they are handed to the writer, at least MAX_NUMBER_LENGTH
+/// @return output buffer
+output_buffer create_output_buffer(async_writer &writer, int precision = -1, size_t size = OUTPUT_BUFFER_SIZE) {
+    return {nullptr, &writer, std::vector<char>(size), 0, precision};
+}
+
+
+/// @brief Write block of text to the stream or writer of the buffer, bypassing the buffer
+/// @param buffer output buffer
+/// @param data text to write
+/// @param length length of the text
+void write_block(output_buffer &buffer, const char *data, size_t length) {
+    if(buffer.writer) {
+        async_write(*buffer.writer, data, length);
+    }
+    else {
+        buffer.out->write(data, length);
+    }
+}
+
+
+/// @brief Write buffered text to the stream or writer
+/// @param buffer output buffer
+void flush_buffer(output_buffer &buffer) {
+    write_block(buffer, buffer.data.data(), buffer.used);
+    buffer.used = 0;
+}
+
+
+/// @brief Make room for text of a length, flushing the buffer when it is too full
+/// @param buffer output buffer
+/// @param length length of the text
+/// @return position to write the text to
+inline char *reserve_output(output_buffer &buffer, size_t length) {
+    if(buffer.used + length > buffer.data.size()) {
+        flush_buffer(buffer);
+    }
+    return buffer.data.data() + buffer.used;
+}
+
+
+/// @brief Append text
+/// @param buffer output buffer
+/// @param text text to append
+inline void write_text(output_buffer &buffer, std::string_view text) {
+    if(text.size() > buffer.data.size()) {
+        flush_buffer(buffer);
+        write_block(buffer, text.data(), text.size());
+        return;
+    }
+    std::memcpy(reserve_output(buffer, text.size()), text.data(), text.size());
+    buffer.used += text.size();
+}
+
+
+/// @brief Append character
+/// @param buffer output buffer
+/// @param c character to append
+inline void write_char(output_buffer &buffer, char c) {
+    *reserve_output(buffer, 1) = c;
+    buffer.used++;
+}
+
+
+/// @brief Format number with std::to_chars
+/// @param first start of room for MAX_NUMBER_LENGTH characters
+/// @param value number to format
+/// @param precision significant digits of floating point numbers, negative for the shortest round trip text
+/// @return number of characters
+template<typename Number>
+inline size_t format_number(char *first, Number value, int precision) {
+    std::to_chars_result result;
+    if constexpr(std::is_floating_point_v<Number>) {
+        result = precision < 0 ? std::to_chars(first, first + MAX_NUMBER_LENGTH, value)
+                               : std::to_chars(first, first + MAX_NUMBER_LENGTH, value, std::chars_format::general, precision);
+    }
+    else {
+        result = std::to_chars(first, first + MAX_NUMBER_LENGTH, value);
+    }
+    if(result.ec != std::errc()) {
+        throw std::runtime_error("number does not fit in MAX_NUMBER_LENGTH characters");
+    }
+    return result.ptr - first;
+}
+
+
+/// @brief Append number, floating point numbers with the precision of the buffer
+/// @param buffer output buffer
+/// @param value number to append
+template<typename Number>
+inline void write_number(output_buffer &buffer, Number value) {
+    buffer.used += format_number(reserve_output(buffer, MAX_NUMBER_LENGTH), value, buffer.precision);
+}
+
+
+/// @brief Append row of comma separated numbers ending with a new line
+/// @param buffer output buffer
+/// @param values numbers of the row
+template<typename... Numbers>
+inline void write_csv_row(output_buffer &buffer, Numbers... values) {
+    bool first = true;
+    ((first ? void() : write_char(buffer, ','), first = false, write_number(buffer, values)), ...);
+    write_char(buffer, '\n');
+}
@@ -1,17 +1,44 @@
+#pragma once
+
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 #include <vector>
+#include <map>
+#include <tuple>
+#include <limits>
+#include <functional>
+#include <string>
+#include <mutex>
+#include <stdexcept>
+#include <cstdint>
 
 #include "entt/entt.hpp"
+#include "atmosphere.cpp"
+#include "drag.cpp"
+#include "wind.cpp"
+#include "output.cpp"
 
 const float GRAVITY = 9.8;
 const float AIR_DENSITY = 1.225; // at 15 degrees Celsius and 1 atm
 const float DRAG_COEFFICIENT = 0.47; // for a sphere
 const float BULLET_AREA = 0.0005067; // 7.62 mm bullet
+const float SPEED_OF_SOUND = 340.3; // at 15 degrees Celsius
 const float RADIAN_TO_DEGREE = 180.0/3.14159265359;
+const float DEGREE_TO_RADIAN = 3.14159265359/180.0;
 
 const int MAX_ITERATIONS = 10000;
 const int MAX_SHOTS = 4;
+const int FINE_SHOTS = 2; // shots at the requested time step after converging on a coarse one
+const float COARSE_STEP_FACTOR = 10.0; // coarse time step relative to the requested one
+const int STEPS_PER_FLIGHT = 16; // initial guess of the number of steps for automatic time step selection
+const int MAX_STEP_HALVINGS = 16;
+const int MAX_ROOT_ITERATIONS = 32;
+const int MAX_DECIMATION_WINDOW = 256; // most points skipped in a row when simplifying history
+const float ROOT_TOLERANCE = 1e-6;
+const int FAN_ROUNDS = 3; // fans of elevations narrowing the bracket before the final shot
+const float FAN_SPREAD = 8.0*DEGREE_TO_RADIAN; // elevations of the first fan around the seed, in radians each side
+const int MAX_FAN_WIDENINGS = 3;
 
 struct position {
     float x;
@@ -31,6 +58,12 @@ struct acceleration {
     float ddz;
 };
 
+/// @brief Rounding errors lost when adding steps to position and velocity, used by compensated summation
+struct compensation {
+    position pos;
+    velocity vel;
+};
+
 struct mass {
     float value;
 };
@@ -39,28 +72,275 @@ struct drag_coefficient {
     float value;
 };
 
+/// @brief Drag coefficient of the bullet depending on Mach number
+struct drag_curve {
+    const drag_table *table;
+};
 
-/// @brief Update acceleration based on drag force and gravity
-/// @param registry entt registry containing bullet
+/// @brief Branch of the firing solution to a target
+enum class trajectory_arc {
+    direct, // flat trajectory with the larger horizontal velocity
+    lofted  // high trajectory with the smaller horizontal velocity
+};
+
+/// @brief Air around the bullets, shared by all bullets of a simulation
+struct environment {
+    const atmosphere *air = nullptr; // density changing with height, without it density is constant
+    const wind_field *wind = nullptr; // wind changing with position, without it the air is still
+};
+
+/// @brief Event that happens when the event function of the bullet state changes sign
+struct event {
+    std::string name;
+    std::function<float(position, velocity)> function;
+    int direction = 0; // 1 only when rising, -1 only when falling, 0 both
+    bool terminal = false; // stop simulation of the bullet at the event
+};
+
+/// @brief Event located between time steps
+struct event_record {
+    size_t event; // index of the event in the list of events
+    float time;
+    position pos;
+    velocity vel;
+};
+
+/// @brief Initial conditions of a bullet
+struct launch {
+    position start;
+    position aim;
+    velocity vel;
+    float mass;
+    std::vector<position> *history = nullptr;
+    const std::vector<event> *events = nullptr;
+    float history_tolerance = 0.0f; // allowed deviation of the recorded history from the trajectory, 0 records every step
+    const drag_table *drag = nullptr; // drag coefficient depending on Mach number, without it the coefficient is constant
+    bool compensated = false; // integrate in float with compensated summation, rounding errors do not build up over long flights
+};
+
+/// @brief Reason the simulation of a bullet stopped
+enum class termination_reason {
+    none, // bullet is still in flight
+    passed_target,
+    ground,
+    max_time,
+    out_of_bounds,
+    event,
+    max_iterations
+};
+
+/// @brief Conditions that stop the simulation of a bullet before it passes the target
+struct simulation_limits {
+    float floor = -std::numeric_limits<float>::infinity();
+    float max_time = std::numeric_limits<float>::infinity();
+    position bounds_min = {-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()};
+    position bounds_max = {std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()};
+};
+
+/// @brief Bookkeeping of a bullet in flight
+struct shot {
+    position start;
+    position aim;
+    position closest;
+    position previous;
+    velocity previous_velocity;
+    position impact;
+    velocity impact_velocity;
+    float min_distance;
+    float closest_time;
+    float time;
+    float apex;
+    termination_reason reason;
+};
+
+/// @brief Recorded history of a bullet, simplified as the points are produced
+/// A point is kept only when the segment from the last kept point to the newest one
+/// would get further than tolerance from any of the skipped points.
+struct history_recorder {
+    std::vector<position> *points;
+    float tolerance;
+    std::vector<position> pending = {}; // skipped points since the last kept one
+    position anchor = {}; // last kept point
+    bool has_anchor = false;
+};
+
+/// @brief Values of event functions at the previous step and events found so far
+struct event_tracking {
+    const std::vector<event> *events;
+    std::vector<float> previous_values;
+    std::vector<event_record> records;
+};
+
+/// @brief Result of a simulated shot
+struct shot_result {
+    position closest;
+    float time_of_flight;
+    position impact; // position where the simulation stopped
+    velocity impact_velocity;
+    termination_reason reason;
+    std::vector<event_record> events;
+    float apex; // highest position of the trajectory
+};
+
+/// @brief Scalars describing a shot, accumulated during the simulation without storing its history
+struct trajectory_summary {
+    float launch_angle;
+    float min_distance;
+    float time_of_flight;
+    float apex;
+    velocity impact_velocity;
+    float impact_energy;
+};
+
+
+/// @brief State of one bullet seen by the force terms
+struct force_input {
+    const position &pos;
+    const velocity &vel;
+    float mass;
+    const environment &env;
+    const drag_table *curve; // only read by mach_coefficient
+};
+
+/// @brief Air density and speed of sound of 15 degrees Celsius at sea level
+struct constant_density {
+    static float density(const force_input &) { return AIR_DENSITY; }
+    static float speed_of_sound(const force_input &) { return SPEED_OF_SOUND; }
+};
+
+/// @brief Air density and speed of sound changing with height, read from the atmosphere of the environment
+struct layered_density {
+    static float density(const force_input &in) { return get_air_density(*in.env.air, in.pos.y); }
+    static float speed_of_sound(const force_input &in) { return get_speed_of_sound(*in.env.air, in.pos.y); }
+};
+
+/// @brief Air standing still, velocity relative to the air is the velocity of the bullet
+struct still_air {
+    static velocity air_velocity(const force_input &in) { return in.vel; }
+};
+
+/// @brief Air moving with the wind field of the environment
+struct grid_wind {
+    static velocity air_velocity(const force_input &in) {
+        wind_vector w = sample_wind(*in.env.wind, in.pos.x, in.pos.y, in.pos.z);
+        return {in.vel.dx - w.u, in.vel.dy - w.v, in.vel.dz - w.w};
+    }
+};
+
+/// @brief Drag coefficient of a sphere
+struct constant_coefficient {
+    template<typename Density>
+    static float get(const force_input &, float) { return DRAG_COEFFICIENT; }
+};
+
+/// @brief Drag coefficient from the Mach number and the drag curve of the bullet
+struct mach_coefficient {
+    template<typename Density>
+    static float get(const force_input &in, float speed) { return get_drag_coefficient(*in.curve, speed/Density::speed_of_sound(in)); }
+};
+
+/// @brief Constant downward acceleration
+struct gravity_force {
+    template<typename Coefficient>
+    static void apply(acceleration &acc, const force_input &) {
+        acc.ddy -= GRAVITY;
+    }
+};
+
+/// @brief Drag force proportional to the square of velocity relative to the air
+/// @tparam Density source of air density and speed of sound
+/// @tparam Air source of air movement
+template<typename Density, typename Air>
+struct quadratic_drag {
+    template<typename Coefficient>
+    static void apply(acceleration &acc, const force_input &in) {
+        // calculate total velocity relative to the air
+        velocity air_vel = Air::air_velocity(in);
+        float speed = sqrt(air_vel.dx * air_vel.dx + air_vel.dy * air_vel.dy + air_vel.dz * air_vel.dz);
+        if(speed <= 0) {
+            return;
+        }
+
+        // calculate total drag force and apply it in opposite direction
+        float cd = Coefficient::template get<Density>(in, speed);
+        float drag = speed * Density::density(in) * BULLET_AREA * cd / (2*in.mass);
+        acc.ddx -= drag * air_vel.dx;
+        acc.ddy -= drag * air_vel.dy;
+        acc.ddz -= drag * air_vel.dz;
+    }
+};
+
+/// @brief Sum of force terms fixed at compile time, terms not in the list cost nothing
+/// @tparam Terms force terms, each with a static apply<Coefficient>(acceleration &, const force_input &)
+template<typename... Terms>
+struct force_model {
+    template<typename Coefficient>
+    static void apply(acceleration &acc, const force_input &in) {
+        acc = {0.0f, 0.0f, 0.0f};
+        (Terms::template apply<Coefficient>(acc, in), ...);
+    }
+};
+
+
+/// @brief Update acceleration of all bullets with a force model
+/// @tparam Model force model
+/// @param registry entt registry containing bullets, environment in its context is read by the force terms
+template<typename Model>
 void update_acceleration(entt::registry &registry) {
-    auto view = registry.view<acceleration, const mass, const velocity>();
-
-    view.each([](auto &acc, const auto &mass, const auto &vel) {
-        // calculate total velocity
-        float velocity = sqrt(vel.dx * vel.dx + vel.dy * vel.dy + vel.dz * vel.dz);
-        // calculate total drag force
-        float drag = velocity * velocity * AIR_DENSITY * BULLET_AREA * DRAG_COEFFICIENT / (2*mass.value);
-
-        // calculate drag force components
-        float drag_x = drag * vel.dx / velocity;
-        float drag_y = drag * vel.dy / velocity;
-        float drag_z = drag * vel.dz / velocity;
-
-        // apply drag force in opposite direction
-        acc.ddx = -drag_x;
-        acc.ddy = -drag_y - GRAVITY;
-        acc.ddz = -drag_z;
+    static const environment still{};
+    const auto *found = registry.ctx().find<environment>();
+    const environment &env = found != nullptr ? *found : still;
+
+    // bullets with constant drag coefficient
+    auto view = registry.view<acceleration, const mass, const velocity, const position>(entt::exclude<drag_curve>);
+    view.each([&env](auto &acc, const auto &mass, const auto &vel, const auto &pos) {
+        Model::template apply<constant_coefficient>(acc, {pos, vel, mass.value, env, nullptr});
     });
+
+    // bullets with drag coefficient depending on Mach number
+    auto curve_view = registry.view<acceleration, const mass, const velocity, const position, const drag_curve>();
+    curve_view.each([&env](auto &acc, const auto &mass, const auto &vel, const auto &pos, const auto &curve) {
+        Model::template apply<mach_coefficient>(acc, {pos, vel, mass.value, env, curve.table});
+    });
+}
+
+/// @brief System updating acceleration of all bullets
+using acceleration_system = void (*)(entt::registry &);
+
+/// @brief Choose the force model matching the environment, once before the simulation loop
+/// @param env air around the bullets
+/// @return acceleration system without terms for parts of the environment that are not set
+acceleration_system select_acceleration_system(const environment &env) {
+    if(env.air != nullptr && env.wind != nullptr) {
+        return &update_acceleration<force_model<gravity_force, quadratic_drag<layered_density, grid_wind>>>;
+    }
+    if(env.air != nullptr) {
+        return &update_acceleration<force_model<gravity_force, quadratic_drag<layered_density, still_air>>>;
+    }
+    if(env.wind != nullptr) {
+        return &update_acceleration<force_model<gravity_force, quadratic_drag<constant_density, grid_wind>>>;
+    }
+    return &update_acceleration<force_model<gravity_force, quadratic_drag<constant_density, still_air>>>;
+}
+
+
+/// @brief Update acceleration based on drag force and gravity
+/// @param registry entt registry containing bullet, air density and wind are taken from environment in its context
+void update_acceleration(entt::registry &registry) {
+    const auto *env = registry.ctx().find<environment>();
+    select_acceleration_system(env != nullptr ? *env : environment{})(registry);
+}
+
+
+/// @brief Add value to a sum, keeping the rounding error of the addition for the next one (Kahan summation)
+/// @param sum running sum
+/// @param error rounding error carried from the previous additions
+/// @param value value to add
+inline void add_compensated(float &sum, float &error, float value) {
+    float corrected = value - error;
+    float next = sum + corrected;
+    error = (next - sum) - corrected;
+    sum = next;
 }
 
 
@@ -68,7 +348,7 @@ void update_acceleration(entt::registry &registry) {
 /// @param registry entt registry containing bullet
 /// @param dt time step in seconds
 void update_velocity(entt::registry &registry, float dt) {
-    auto view = registry.view<velocity, const acceleration>();
+    auto view = registry.view<velocity, const acceleration>(entt::exclude<compensation>);
 
     
     view.each([&dt](auto &vel, const auto &acc) {
@@ -77,6 +357,14 @@ void update_velocity(entt::registry &registry, float dt) {
         vel.dy += acc.ddy*dt;
         vel.dz += acc.ddz*dt;
     });
+
+    // bullets integrated with compensated summation
+    auto compensated = registry.view<velocity, const acceleration, compensation>();
+    compensated.each([&dt](auto &vel, const auto &acc, auto &error) {
+        add_compensated(vel.dx, error.vel.dx, acc.ddx*dt);
+        add_compensated(vel.dy, error.vel.dy, acc.ddy*dt);
+        add_compensated(vel.dz, error.vel.dz, acc.ddz*dt);
+    });
 }
 
 
@@ -84,7 +372,7 @@ void update_velocity(entt::registry &registry, float dt) {
 /// @param registry entt registry containing bullet
 /// @param dt time step in seconds
 void update_position(entt::registry &registry, float dt) {
-    auto view = registry.view<position, const velocity>();
+    auto view = registry.view<position, const velocity>(entt::exclude<compensation>);
 
     view.each([&dt](auto &pos,const auto &vel) {
         // update position based on velocity
@@ -92,20 +380,38 @@ void update_position(entt::registry &registry, float dt) {
         pos.y += vel.dy * dt;
         pos.z += vel.dz * dt;
     });
+
+    // bullets integrated with compensated summation
+    auto compensated = registry.view<position, const velocity, compensation>();
+    compensated.each([&dt](auto &pos, const auto &vel, auto &error) {
+        add_compensated(pos.x, error.pos.x, vel.dx*dt);
+        add_compensated(pos.y, error.pos.y, vel.dy*dt);
+        add_compensated(pos.z, error.pos.z, vel.dz*dt);
+    });
 }
 
 
-/// @brief Print position and velocity of bullet in csv format
-/// @param registry entt registry containing bullet
-void print_position_and_velocity(entt::registry &registry) {
+/// @brief Print position and velocity of bullets in csv format
+/// @param registry entt registry containing bullets
+/// @param buffer output buffer, rows are written to its stream when it is full or flushed
+void print_position_and_velocity(entt::registry &registry, output_buffer &buffer) {
     auto view = registry.view<const position, const velocity>();
 
-    view.each([](const auto &pos, const auto &vel) {
-        std::cout <<  pos.x << ", " << pos.y << ", " << pos.z << ",     " << vel.dx << ", " <<vel.dy << ", " << vel.dz  << std::endl;
+    view.each([&buffer](const auto &pos, const auto &vel) {
+        write_csv_row(buffer, pos.x, pos.y, pos.z, vel.dx, vel.dy, vel.dz);
     });
 }
 
 
+/// @brief Print position and velocity of bullets in csv format to standard output
+/// @param registry entt registry containing bullets
+void print_position_and_velocity(entt::registry &registry) {
+    output_buffer buffer = create_output_buffer(std::cout, -1, 4096);
+    print_position_and_velocity(registry, buffer);
+    flush_buffer(buffer);
+}
+
+
 /// @brief Get bullet position
 /// @param registry entt registry containing bullet
 /// @return bullet position
@@ -155,17 +461,49 @@ float get_horizontal_distance(position a, position b) {
 
 
 /// @brief Check if position is behind a target
+/// Behind means past the vertical plane through the target perpendicular to the horizontal line from start to target,
+/// the plane get_crossing_fraction interpolates to. A bullet drifting sideways, for example in a cross wind, has not
+/// passed the target while it is short of that plane, even when one of its coordinates is further from the start.
 /// @param pos bullet position
 /// @param start starting position
 /// @param target target position
 /// @return true if position is behind target
 bool is_behind(position pos, position start, position target){
-    // check if bullet is behind target in x or z axis
-    // check if current position is further away than at the start
-    bool behind_x = abs(target.x - start.x) < abs(pos.x - start.x);
-    bool behind_z = abs(target.z - start.z) < abs(pos.z - start.z);
+    // check if bullet crossed the vertical plane of the target along the direction from start to target,
+    // sideways drift does not count as passing the target
+    float dx = target.x - start.x;
+    float dz = target.z - start.z;
+    return (pos.x - start.x)*dx + (pos.z - start.z)*dz > dx*dx + dz*dz;
+}
+
 
-    return behind_x || behind_z;
+/// @brief Linear interpolation between two positions
+/// @param a position at fraction 0
+/// @param b position at fraction 1
+/// @param fraction fraction of the way from a to b
+/// @return interpolated position
+position interpolate(position a, position b, float fraction) {
+    return {a.x + (b.x - a.x)*fraction, a.y + (b.y - a.y)*fraction, a.z + (b.z - a.z)*fraction};
+}
+
+
+/// @brief Fraction of the step from a to b at which the bullet crosses the vertical plane of the target
+/// @param a position before the crossing
+/// @param b position after the crossing
+/// @param start starting position
+/// @param target target position
+/// @return fraction between 0 and 1
+float get_crossing_fraction(position a, position b, position start, position target) {
+    // project horizontal positions on the direction from start to target
+    float dx = target.x - start.x;
+    float dz = target.z - start.z;
+    float sa = (a.x - start.x)*dx + (a.z - start.z)*dz;
+    float sb = (b.x - start.x)*dx + (b.z - start.z)*dz;
+    float st = dx*dx + dz*dz;
+    if(sb == sa) {
+        return 1.0f;
+    }
+    return std::clamp((st - sa)/(sb - sa), 0.0f, 1.0f);
 }
 
 
@@ -173,8 +511,9 @@ bool is_behind(position pos, position start, position target){
 /// @param start starting position
 /// @param aim position to aim at
 /// @param velocity velocity of the bullet at the start
+/// @param arc which of the two solutions to return
 /// @return optiomal horizontal velocity
-float get_optimal_horizontal_velocity(position start, position aim, float velocity) {
+float get_optimal_horizontal_velocity(position start, position aim, float velocity, trajectory_arc arc = trajectory_arc::direct) {
     float sh = get_horizontal_distance(start, aim);
     float sv = aim.y - start.y;
     float sv2 = sv*sv;
@@ -190,7 +529,8 @@ float get_optimal_horizontal_velocity(position start, position aim, float veloci
     }
     float v1 = (-b + sqrt(discriminant))/(2*a);
     float v2 = (-b - sqrt(discriminant))/(2*a);
-    float v = std::max(v1, v2);
+    // larger horizontal velocity gives the flat trajectory, smaller the lofted one
+    float v = arc == trajectory_arc::direct ? std::max(v1, v2) : std::min(v1, v2);
     
     if(v > 0) {
         return sqrt(v);
@@ -232,9 +572,10 @@ velocity aim_strait(position start, position aim, float velocity) {
 /// @param start starting position
 /// @param aim position to aim at
 /// @param velocity velocity of the bullet at the start
+/// @param arc which of the two solutions to aim for
 /// @return velocity vector
-velocity aim_with_gravity(position start, position aim, float velocity){
-    float vh = get_optimal_horizontal_velocity(start, aim, velocity);
+velocity aim_with_gravity(position start, position aim, float velocity, trajectory_arc arc = trajectory_arc::direct){
+    float vh = get_optimal_horizontal_velocity(start, aim, velocity, arc);
     float vy = get_optimal_vertical_velocity(start, aim, vh);
     float dx = aim.x - start.x;
     float dz = aim.z - start.z;
@@ -246,45 +587,371 @@ velocity aim_with_gravity(position start, position aim, float velocity){
 
 
 
-/// @brief Simulates bullet trajectory
-/// @param start starting position
-/// @param aim point to aim at, not necessarily the target
+/// @brief Check if position is inside the bounding box of the limits
+/// @param pos bullet position
+/// @param limits simulation limits
+/// @return true if position is inside
+bool is_inside(position pos, const simulation_limits &limits) {
+    return pos.x >= limits.bounds_min.x && pos.x <= limits.bounds_max.x
+        && pos.y >= limits.bounds_min.y && pos.y <= limits.bounds_max.y
+        && pos.z >= limits.bounds_min.z && pos.z <= limits.bounds_max.z;
+}
+
+
+/// @brief Track closest position of bullets in flight and stop them on termination events
+/// @param registry entt registry containing bullets
 /// @param dt time step in seconds
-/// @param bullet_mass mass of the bullet 
-/// @param velocity_init initial velocity of the bullet
-/// @return closest horizontal position to target
-position simulate(position start, position aim, float dt, float bullet_mass, velocity vel, std::vector<position> * history) {
-    entt::registry registry;
+/// @param limits conditions that stop bullets before they pass the target
+/// @return number of bullets still in flight
+int update_shots(entt::registry &registry, float dt, const simulation_limits &limits) {
+    auto view = registry.view<shot, const position, const velocity>();
+    int in_flight = 0;
 
-    // create bullet entity and add components
-    const auto entity = registry.create();
-    registry.emplace<position>(entity, start.x, start.y, start.z);
-    registry.emplace<velocity>(entity, vel.dx, vel.dy, vel.dz);
-    registry.emplace<acceleration>(entity, 0.0f, -GRAVITY, 0.0f);
-    registry.emplace<mass>(entity, bullet_mass);
+    view.each([&dt, &limits, &in_flight](auto &shot, const auto &pos, const auto &vel) {
+        if(shot.reason != termination_reason::none) {
+            return;
+        }
+        shot.time += dt;
+        shot.apex = std::max(shot.apex, pos.y);
+        // bullet moves in a straight line during a step, so events are interpolated exactly
+        shot.impact_velocity = vel;
+        if(is_behind(pos, shot.start, shot.aim)) {
+            float fraction = get_crossing_fraction(shot.previous, pos, shot.start, shot.aim);
+            shot.closest = interpolate(shot.previous, pos, fraction);
+            shot.min_distance = 0.0f;
+            shot.closest_time = shot.time - (1.0f - fraction)*dt;
+            shot.impact = shot.closest;
+            shot.reason = termination_reason::passed_target;
+            return;
+        }
+        if(pos.y < limits.floor) {
+            float fraction = (shot.previous.y - limits.floor)/(shot.previous.y - pos.y);
+            shot.impact = interpolate(shot.previous, pos, fraction);
+            shot.reason = termination_reason::ground;
+            return;
+        }
+        if(!is_inside(pos, limits)) {
+            shot.impact = pos;
+            shot.reason = termination_reason::out_of_bounds;
+            return;
+        }
+        // udpate closest horizontal position
+        float current_distance = get_horizontal_distance(pos, shot.aim);
+        if(current_distance < shot.min_distance) {
+            shot.min_distance = current_distance;
+            shot.closest = pos;
+            shot.closest_time = shot.time;
+        }
+        shot.previous = pos;
+        shot.previous_velocity = vel;
+        if(shot.time >= limits.max_time) {
+            shot.impact = pos;
+            shot.reason = termination_reason::max_time;
+            return;
+        }
+        in_flight++;
+    });
+    return in_flight;
+}
+
+
+/// @brief Stop integrating terminated bullets by removing their velocity and acceleration
+/// Removal swaps the last bullet into the freed slot, so the bullets in flight stay contiguous
+/// and the systems iterate only over them, short shots of a volley do not slow down the long ones.
+/// @param registry entt registry containing bullets
+void remove_finished(entt::registry &registry) {
+    std::vector<entt::entity> finished;
+    auto view = registry.view<const shot, const velocity>();
+    view.each([&finished](auto entity, const auto &shot, const auto &) {
+        if(shot.reason != termination_reason::none) {
+            finished.push_back(entity);
+        }
+    });
+    registry.remove<velocity, acceleration, compensation>(finished.begin(), finished.end());
+}
+
+
+/// @brief Distance of a point from a segment
+/// @param p point
+/// @param a start of the segment
+/// @param b end of the segment
+/// @return distance in meters
+float get_segment_distance(position p, position a, position b) {
+    float abx = b.x - a.x;
+    float aby = b.y - a.y;
+    float abz = b.z - a.z;
+    float length2 = abx*abx + aby*aby + abz*abz;
+    float fraction = 0.0f;
+    if(length2 > 0) {
+        fraction = std::clamp(((p.x - a.x)*abx + (p.y - a.y)*aby + (p.z - a.z)*abz)/length2, 0.0f, 1.0f);
+    }
+    return get_distance(p, interpolate(a, b, fraction));
+}
 
 
-    float min_distance = get_horizontal_distance(start, aim);
-    position closest_position = start;
-    position current_position;
+/// @brief Add a point to the history, keep the previous point only when the history would not be within tolerance without it
+/// @param recorder history recorder of the bullet
+/// @param pos newest position of the bullet
+void record_position(history_recorder &recorder, position pos) {
+    if(recorder.tolerance <= 0 || !recorder.has_anchor) {
+        recorder.points->push_back(pos);
+        recorder.anchor = pos;
+        recorder.has_anchor = true;
+        return;
+    }
+    bool within = recorder.pending.size() < static_cast<size_t>(MAX_DECIMATION_WINDOW);
+    for(size_t i = 0; within && i < recorder.pending.size(); i++) {
+        within = get_segment_distance(recorder.pending[i], recorder.anchor, pos) <= recorder.tolerance;
+    }
+    if(!within) {
+        // last skipped point becomes the new anchor
+        recorder.anchor = recorder.pending.back();
+        recorder.points->push_back(recorder.anchor);
+        recorder.pending.clear();
+    }
+    recorder.pending.push_back(pos);
+}
 
-    // update bullet position until it is behind the target
-    for(int i = 0; i < MAX_ITERATIONS; i++) {
-        current_position = update(registry, dt);
-        if(history != nullptr) {
-            history->push_back(current_position);
+
+/// @brief Record history of bullets in flight
+/// @param registry entt registry containing bullets
+void update_history(entt::registry &registry) {
+    auto view = registry.view<history_recorder, const shot, const position, const velocity>();
+
+    view.each([](auto &recorder, const auto &shot, const auto &pos, const auto &) {
+        if(shot.reason == termination_reason::none) {
+            record_position(recorder, pos);
         }
-        if(is_behind(current_position, start, aim)) {
+    });
+}
+
+
+/// @brief Keep the last point of every simplified history
+/// @param registry entt registry containing bullets
+void finish_history(entt::registry &registry) {
+    auto view = registry.view<history_recorder>();
+
+    view.each([](auto &recorder) {
+        if(!recorder.pending.empty()) {
+            recorder.points->push_back(recorder.pending.back());
+            recorder.pending.clear();
+        }
+    });
+}
+
+
+/// @brief Find root of a function on [0, 1] with a sign change, Illinois variant of regula falsi
+/// @param f function
+/// @param f0 value at 0
+/// @param f1 value at 1
+/// @return argument of the root
+template<typename Function>
+float find_root(const Function &f, float f0, float f1) {
+    float a = 0.0f;
+    float b = 1.0f;
+    float x = 0.0f;
+    int side = 0;
+    for(int i = 0; i < MAX_ROOT_ITERATIONS; i++) {
+        x = (a*f1 - b*f0)/(f1 - f0);
+        float fx = f(x);
+        if(fx == 0.0f || b - a < ROOT_TOLERANCE) {
             break;
         }
-        // udpate closest horizontal position
-        float current_distance = get_horizontal_distance(current_position, aim);
-        if(current_distance < min_distance) {
-            min_distance = current_distance;
-            closest_position = current_position;
+        if((fx > 0) == (f1 > 0)) {
+            b = x;
+            f1 = fx;
+            // halve the value at the stale end so it does not get stuck
+            if(side == -1) {
+                f0 /= 2;
+            }
+            side = -1;
+        }
+        else {
+            a = x;
+            f0 = fx;
+            if(side == 1) {
+                f1 /= 2;
+            }
+            side = 1;
+        }
+    }
+    return x;
+}
+
+
+/// @brief Evaluate event functions of bullets in flight and locate sign changes between time steps
+/// The state changes linearly during a step, so the root is searched on the linear interpolant of the state.
+/// @param registry entt registry containing bullets
+/// @param dt time step in seconds
+void update_events(entt::registry &registry, float dt) {
+    auto view = registry.view<event_tracking, shot, const position, const velocity>();
+
+    view.each([&dt](auto &tracking, auto &shot, const auto &pos, const auto &vel) {
+        if(shot.reason != termination_reason::none) {
+            return;
+        }
+        const auto &events = *tracking.events;
+        for(size_t i = 0; i < events.size(); i++) {
+            float previous_value = tracking.previous_values[i];
+            float value = events[i].function(pos, vel);
+            tracking.previous_values[i] = value;
+
+            bool rising = previous_value < 0 && value >= 0;
+            bool falling = previous_value > 0 && value <= 0;
+            if(!(rising && events[i].direction >= 0) && !(falling && events[i].direction <= 0)) {
+                continue;
+            }
+
+            position previous = shot.previous;
+            velocity previous_velocity = shot.previous_velocity;
+            auto state_at = [&](float fraction) {
+                position p = interpolate(previous, pos, fraction);
+                velocity v = {previous_velocity.dx + (vel.dx - previous_velocity.dx)*fraction,
+                              previous_velocity.dy + (vel.dy - previous_velocity.dy)*fraction,
+                              previous_velocity.dz + (vel.dz - previous_velocity.dz)*fraction};
+                return std::make_pair(p, v);
+            };
+            float fraction = find_root([&](float f) {
+                auto [p, v] = state_at(f);
+                return events[i].function(p, v);
+            }, previous_value, value);
+
+            auto [event_pos, event_vel] = state_at(fraction);
+            tracking.records.push_back({i, shot.time + fraction*dt, event_pos, event_vel});
+            if(events[i].terminal) {
+                shot.impact = event_pos;
+                shot.impact_velocity = event_vel;
+                shot.reason = termination_reason::event;
+                break;
+            }
+        }
+    });
+}
+
+
+/// @brief Event at the highest point of the trajectory
+/// @return apex event
+event apex_event() {
+    return {"apex", [](position, velocity vel) { return vel.dy; }, -1, false};
+}
+
+
+/// @brief Event when the bullet falls through a height
+/// @param height height in meters
+/// @param terminal stop the bullet at the event
+/// @return height event
+event height_event(float height, bool terminal = true) {
+    return {"height", [height](position pos, velocity) { return pos.y - height; }, -1, terminal};
+}
+
+
+/// @brief Event when the bullet crosses a plane in the direction of its normal
+/// @param point point on the plane
+/// @param normal normal of the plane
+/// @param terminal stop the bullet at the event
+/// @return plane event
+event plane_event(position point, position normal, bool terminal = false) {
+    return {"plane", [point, normal](position pos, velocity) {
+        return (pos.x - point.x)*normal.x + (pos.y - point.y)*normal.y + (pos.z - point.z)*normal.z;
+    }, 1, terminal};
+}
+
+
+/// @brief Simulates trajectories of several bullets at once, each bullet is one entity in the registry
+/// @param launches initial conditions of the bullets
+/// @param dt time step in seconds
+/// @param limits conditions that stop bullets before they pass their aim
+/// @param env air around the bullets
+/// @return closest horizontal position to aim, time of flight and termination for every bullet
+std::vector<shot_result> simulate_batch(const std::vector<launch> &launches, float dt, const simulation_limits &limits = {}, const environment &env = {}) {
+    entt::registry registry;
+    registry.ctx().emplace<environment>(env);
+    std::vector<entt::entity> entities;
+
+    // create bullet entities and add components
+    for(const auto &l : launches) {
+        const auto entity = registry.create();
+        registry.emplace<position>(entity, l.start.x, l.start.y, l.start.z);
+        registry.emplace<velocity>(entity, l.vel.dx, l.vel.dy, l.vel.dz);
+        registry.emplace<acceleration>(entity, 0.0f, -GRAVITY, 0.0f);
+        registry.emplace<mass>(entity, l.mass);
+        if(l.drag != nullptr) {
+            registry.emplace<drag_curve>(entity, l.drag);
+        }
+        if(l.compensated) {
+            registry.emplace<compensation>(entity);
+        }
+
+        shot s{};
+        s.start = l.start;
+        s.aim = l.aim;
+        s.closest = l.start;
+        s.previous = l.start;
+        s.previous_velocity = l.vel;
+        s.impact = l.start;
+        s.impact_velocity = l.vel;
+        s.min_distance = get_horizontal_distance(l.start, l.aim);
+        s.apex = l.start.y;
+        s.reason = termination_reason::none;
+        registry.emplace<shot>(entity, s);
+
+        if(l.history != nullptr) {
+            registry.emplace<history_recorder>(entity, history_recorder{l.history, l.history_tolerance});
+        }
+
+        if(l.events != nullptr && !l.events->empty()) {
+            std::vector<float> values;
+            for(const auto &e : *l.events) {
+                values.push_back(e.function(l.start, l.vel));
+            }
+            registry.emplace<event_tracking>(entity, l.events, values, std::vector<event_record>());
+        }
+        entities.push_back(entity);
+    }
+
+    // update bullets until all of them are terminated
+    acceleration_system accelerate = select_acceleration_system(env);
+    int in_flight = static_cast<int>(launches.size());
+    for(int i = 0; i < MAX_ITERATIONS && in_flight > 0; i++) {
+        update_velocity(registry, dt);
+        update_position(registry, dt);
+        accelerate(registry);
+        update_history(registry);
+        update_events(registry, dt);
+        int still_in_flight = update_shots(registry, dt, limits);
+        if(still_in_flight < in_flight) {
+            remove_finished(registry);
+        }
+        in_flight = still_in_flight;
+    }
+
+    finish_history(registry);
+
+    std::vector<shot_result> results;
+    for(auto entity : entities) {
+        auto &s = registry.get<shot>(entity);
+        if(s.reason == termination_reason::none) {
+            s.impact = s.previous;
+            s.reason = termination_reason::max_iterations;
+        }
+        results.push_back({s.closest, s.closest_time, s.impact, s.impact_velocity, s.reason, {}, s.apex});
+        if(auto *tracking = registry.try_get<event_tracking>(entity)) {
+            results.back().events = std::move(tracking->records);
         }
     }
-    return closest_position;
+    return results;
+}
+
+
+/// @brief Simulates bullet trajectory
+/// @param start starting position
+/// @param aim point to aim at, not necessarily the target
+/// @param dt time step in seconds
+/// @param bullet_mass mass of the bullet 
+/// @param velocity_init initial velocity of the bullet
+/// @return closest horizontal position to target
+position simulate(position start, position aim, float dt, float bullet_mass, velocity vel, std::vector<position> * history) {
+    return simulate_batch({{start, aim, vel, bullet_mass, history}}, dt)[0].closest;
 }
 
 
@@ -307,3 +974,583 @@ float get_launch_angle(velocity vel){
     float vertical_velocity = vel.dy;
     return atan(vertical_velocity / horizontal_velocity);
 }
+
+
+/// @brief Name of the termination reason
+/// @param reason termination reason
+/// @return name used in logs and output
+const char *get_termination_name(termination_reason reason) {
+    switch(reason) {
+        case termination_reason::none: return "none";
+        case termination_reason::passed_target: return "passed_target";
+        case termination_reason::ground: return "ground";
+        case termination_reason::max_time: return "max_time";
+        case termination_reason::out_of_bounds: return "out_of_bounds";
+        case termination_reason::event: return "event";
+        case termination_reason::max_iterations: return "max_iterations";
+    }
+    return "unknown";
+}
+
+
+/// @brief Height at which the bullet would cross the vertical plane of the target if it continued without drag
+/// @param pos position where the bullet stopped
+/// @param vel velocity of the bullet where it stopped
+/// @param start starting position
+/// @param target target position
+/// @return position in the vertical plane of the target
+position extrapolate_to_target(position pos, velocity vel, position start, position target) {
+    float dx = target.x - start.x;
+    float dz = target.z - start.z;
+    float dh = sqrt(dx*dx + dz*dz);
+    // remaining horizontal distance and horizontal velocity along the direction to the target
+    float remaining = dh - ((pos.x - start.x)*dx + (pos.z - start.z)*dz)/dh;
+    float vh = (vel.dx*dx + vel.dz*dz)/dh;
+    if(vh <= 0) {
+        return {target.x, pos.y, target.z};
+    }
+    float t = remaining/vh;
+    return {pos.x + vel.dx*t, pos.y + vel.dy*t - 0.5f*GRAVITY*t*t, pos.z + vel.dz*t};
+}
+
+
+/// @brief Summarize a shot
+/// @param l initial conditions of the bullet
+/// @param result result of the simulation
+/// @param target target position
+/// @return summary of the shot
+trajectory_summary summarize(const launch &l, const shot_result &result, position target) {
+    const auto &v = result.impact_velocity;
+    float speed2 = v.dx*v.dx + v.dy*v.dy + v.dz*v.dz;
+    return {get_launch_angle(l.vel), get_distance(result.closest, target), result.time_of_flight, result.apex, v, 0.5f*l.mass*speed2};
+}
+
+
+/// @brief Firing solution for one arc found by iterative aim correction
+struct firing_solution {
+    trajectory_arc arc;
+    position aim;
+    velocity vel;
+    float min_distance;
+    float time_of_flight;
+    termination_reason reason;
+    position reached; // position of the last shot in the target plane
+    position previous_aim; // aim of the last shot, used for the secant correction
+    float slope; // change of the aim per change of the closest position
+    bool has_previous; // last shot was fired with the same time step
+    int shots;
+    std::vector<event_record> events; // events of the last shot
+    trajectory_summary summary; // summary of the last shot
+    position target; // target the aim is corrected for, position of a moving target at the time of flight
+};
+
+
+/// @brief Target moving with constant acceleration
+struct target_motion {
+    position origin; // position at the launch
+    velocity vel;
+    acceleration acc;
+};
+
+
+/// @brief Position of a moving target
+/// @param motion motion of the target
+/// @param time time since the launch in seconds
+/// @return target position
+position predict_target(const target_motion &motion, float time) {
+    return {motion.origin.x + (motion.vel.dx + 0.5f*motion.acc.ddx*time)*time,
+            motion.origin.y + (motion.vel.dy + 0.5f*motion.acc.ddy*time)*time,
+            motion.origin.z + (motion.vel.dz + 0.5f*motion.acc.ddz*time)*time};
+}
+
+
+/// @brief Move the aim of a solution along with its target, keeping the offset found by the previous shots
+/// The secant of the previous shot is moved as well, so the correction continues where it left off.
+/// @param solution firing solution
+/// @param start starting position
+/// @param target new target position
+/// @param velocity_init initial velocity of the bullet
+void move_target(firing_solution &solution, position start, position target, float velocity_init) {
+    float dy = target.y - solution.target.y;
+    float offset = solution.aim.y - solution.target.y;
+    solution.previous_aim.y += dy;
+    solution.reached.y += dy;
+    solution.target = target;
+
+    // halve the offset while the aim is out of reach of the farther target
+    position aim{target.x, target.y + offset, target.z};
+    while(get_optimal_horizontal_velocity(start, aim, velocity_init, solution.arc) < 0 && std::abs(offset) > 1e-3f) {
+        offset /= 2;
+        aim.y = target.y + offset;
+    }
+    solution.aim = aim;
+}
+
+
+/// @brief Stage of the solver, a number of corrective shots with the same time step
+struct solve_stage {
+    float dt;
+    int shots;
+};
+
+
+/// @brief Name of the trajectory arc
+/// @param arc trajectory arc
+/// @return name used in logs and output
+const char *get_arc_name(trajectory_arc arc) {
+    return arc == trajectory_arc::direct ? "direct" : "lofted";
+}
+
+
+/// @brief Position of a shot in the vertical plane of the target, bullets stopped before the target are extrapolated
+/// @param result result of the shot
+/// @param start starting position
+/// @param target target position
+/// @return position in the target plane
+position get_reached(const shot_result &result, position start, position target) {
+    if(result.reason != termination_reason::passed_target) {
+        return extrapolate_to_target(result.impact, result.impact_velocity, start, target);
+    }
+    return result.closest;
+}
+
+
+/// @brief Correct aim of a firing solution based on the result of its last shot
+/// @param solution firing solution whose aim is corrected
+/// @param start starting position
+/// @param target target position
+/// @param velocity_init initial velocity of the bullet
+/// @param result result of the shot fired with the current aim
+void correct_aim(firing_solution &solution, position start, position target, float velocity_init, const shot_result &result) {
+    position reached = get_reached(result, start, target);
+
+    // pretend the target is higher by the miss, scaled by the secant slope of the previous shots
+    // the lofted arc reacts much stronger to the aim than the direct one
+    if(solution.has_previous && std::abs(reached.y - solution.reached.y) > 1e-6f) {
+        float slope = (solution.aim.y - solution.previous_aim.y)/(reached.y - solution.reached.y);
+        if(slope > 0) {
+            solution.slope = slope;
+        }
+    }
+    float correction_y = (target.y - reached.y)*solution.slope;
+    solution.has_previous = true;
+    solution.previous_aim = solution.aim;
+    solution.reached = reached;
+    solution.min_distance = get_distance(result.closest, target);
+    solution.time_of_flight = result.time_of_flight;
+    solution.reason = result.reason;
+    solution.shots++;
+
+    // halve the correction while the aim is out of reach
+    position aim = solution.aim;
+    aim.y += correction_y;
+    while(get_optimal_horizontal_velocity(start, aim, velocity_init, solution.arc) < 0 && std::abs(correction_y) > 1e-3f) {
+        correction_y /= 2;
+        aim.y = solution.aim.y + correction_y;
+    }
+    solution.aim = aim;
+}
+
+
+/// @brief Default solver schedule, converge on a coarse time step and finish with a few shots on the requested one
+/// @param dt requested time step in seconds
+/// @return solver stages
+std::vector<solve_stage> get_default_stages(float dt) {
+    return {{dt*COARSE_STEP_FACTOR, MAX_SHOTS}, {dt, FINE_SHOTS}};
+}
+
+
+/// @brief Default limits for the solver, stop bullets that fall below both start and target
+/// A trajectory is concave so it cannot get below both before crossing the target plane.
+/// @param start starting position
+/// @param target target position
+/// @return simulation limits
+simulation_limits get_default_limits(position start, position target) {
+    simulation_limits limits;
+    limits.floor = std::min(start.y, target.y);
+    return limits;
+}
+
+
+/// @brief Settings of the solver
+struct solver_options {
+    std::vector<solve_stage> stages; // time steps and numbers of shots, from the coarsest to the finest
+    simulation_limits limits; // conditions that stop bullets before they pass the target
+    std::vector<std::vector<position>> *curves = nullptr; // storage for trajectories of all shots, without it no history is recorded
+    float curve_tolerance = 0.0f; // allowed deviation of stored trajectories from the simulated ones, 0 stores every step
+    std::ostream *log = nullptr; // stream to report every shot to
+    const std::vector<event> *events = nullptr; // events to detect in every shot
+    environment env; // air around the bullets
+    const drag_table *drag = nullptr; // drag coefficient of the bullet depending on Mach number
+    bool compensated = false; // integrate with compensated summation
+    const target_motion *motion = nullptr; // moving target, without it the target stands still
+    int fan_lanes = 0; // elevations simulated together to bracket a stationary target, 0 corrects the aim shot by shot
+    std::function<void(std::vector<position> &&)> curve_sink; // takes every completed trajectory, which is then released from curves
+};
+
+
+/// @brief Default settings of the solver
+/// @param start starting position
+/// @param target target position
+/// @param dt requested time step in seconds
+/// @return solver options
+solver_options get_default_options(position start, position target, float dt) {
+    solver_options options;
+    options.stages = get_default_stages(dt);
+    options.limits = get_default_limits(start, target);
+    return options;
+}
+
+
+/// @brief Launch velocity towards the target at an elevation
+/// @param start starting position
+/// @param target target position
+/// @param velocity_init initial velocity of the bullet
+/// @param elevation elevation in radians
+/// @return launch velocity, along the x axis for a target directly above or below the start
+velocity aim_at_elevation(position start, position target, float velocity_init, float elevation) {
+    float dx = target.x - start.x;
+    float dz = target.z - start.z;
+    float dh = sqrt(dx*dx + dz*dz);
+    float vh = velocity_init*cos(elevation);
+    float vy = velocity_init*sin(elevation);
+    if(dh == 0) {
+        return {vh, vy, 0.0f};
+    }
+    return {vh*dx/dh, vy, vh*dz/dh};
+}
+
+
+/// @brief Hand completed trajectories to the curve sink of the options and release them
+/// @param options settings of the solver
+void release_curves(const solver_options &options) {
+    if(options.curves == nullptr || !options.curve_sink) {
+        return;
+    }
+    for(auto &curve : *options.curves) {
+        options.curve_sink(std::move(curve));
+    }
+    options.curves->clear();
+}
+
+
+/// @brief Find firing solutions of both arcs by simulating fans of elevations and narrowing the pair bracketing the target
+/// The fans of both arcs are simulated together as one batch. The bracket closest to the analytic elevation of the arc
+/// is taken, so the arcs on both sides of the maximal range stay apart. Every fan shrinks the bracket by the number of lanes,
+/// the final elevation is interpolated in the last bracket and verified by one shot of each arc, again as one batch.
+/// @param start starting position
+/// @param target target position
+/// @param velocity_init initial velocity of the bullet
+/// @param bullet_mass mass of the bullet
+/// @param options settings of the solver, the last stage gives the time step
+/// @return direct and lofted firing solution, shots counts the fans and the final shot
+std::vector<firing_solution> solve_by_fan(position start, position target, float velocity_init, float bullet_mass, const solver_options &options) {
+    float dt = options.stages.back().dt;
+    int lanes = std::max(options.fan_lanes, 2);
+
+    // bracket of elevations narrowed for each arc
+    struct fan_state {
+        trajectory_arc arc;
+        float seed;
+        float low;
+        float high;
+        int round = 0;
+        int widenings = 0;
+        int shots = 0;
+    };
+    std::vector<fan_state> fans;
+    for(auto arc : {trajectory_arc::direct, trajectory_arc::lofted}) {
+        float seed = get_launch_angle(aim_with_gravity(start, target, velocity_init, arc));
+        fans.push_back({arc, seed, seed - FAN_SPREAD, seed + FAN_SPREAD});
+    }
+
+    auto height_error = [&](const shot_result &result) {
+        return get_reached(result, start, target).y - target.y;
+    };
+
+    for(;;) {
+        // simulate all elevations of the fans still narrowing together
+        std::vector<launch> launches;
+        std::vector<float> elevations;
+        std::vector<fan_state *> active;
+        for(auto &fan : fans) {
+            if(fan.round >= FAN_ROUNDS) {
+                continue;
+            }
+            active.push_back(&fan);
+            for(int i = 0; i < lanes; i++) {
+                float elevation = std::clamp(fan.low + (fan.high - fan.low)*i/(lanes - 1), -1.55f, 1.55f);
+                elevations.push_back(elevation);
+                launches.push_back({start, target, aim_at_elevation(start, target, velocity_init, elevation), bullet_mass, nullptr, nullptr, 0.0f, options.drag, options.compensated});
+            }
+        }
+        if(active.empty()) {
+            break;
+        }
+        auto results = simulate_batch(launches, dt, options.limits, options.env);
+
+        for(size_t k = 0; k < active.size(); k++) {
+            auto &fan = *active[k];
+            const float *fan_elevations = elevations.data() + k*lanes;
+            const shot_result *fan_results = results.data() + k*lanes;
+            fan.shots++;
+
+            // pair of neighbouring elevations with the target between them, closest to the seed
+            int bracket = -1;
+            float previous_error = height_error(fan_results[0]);
+            for(int i = 1; i < lanes; i++) {
+                float error = height_error(fan_results[i]);
+                if((previous_error <= 0) != (error <= 0)
+                   && (bracket < 0 || std::abs(fan_elevations[i] + fan_elevations[i - 1] - 2*fan.seed) < std::abs(fan_elevations[bracket] + fan_elevations[bracket - 1] - 2*fan.seed))) {
+                    bracket = i;
+                }
+                previous_error = error;
+            }
+
+            if(bracket < 0) {
+                // target is outside of the fan, widen it around the seed
+                if(fan.round > 0 || ++fan.widenings > MAX_FAN_WIDENINGS) {
+                    fan.round = FAN_ROUNDS;
+                    continue;
+                }
+                fan.low = fan.seed - FAN_SPREAD*(1 << fan.widenings);
+                fan.high = fan.seed + FAN_SPREAD*(1 << fan.widenings);
+                continue;
+            }
+            fan.low = fan_elevations[bracket - 1];
+            fan.high = fan_elevations[bracket];
+            float low_error = height_error(fan_results[bracket - 1]);
+            float high_error = height_error(fan_results[bracket]);
+            fan.seed = fan.low + (fan.high - fan.low)*low_error/(low_error - high_error);
+            fan.round++;
+        }
+    }
+
+    // final shots at the elevations interpolated in the brackets
+    size_t first_curve = 0;
+    if(options.curves != nullptr) {
+        first_curve = options.curves->size();
+        options.curves->resize(first_curve + fans.size());
+    }
+    std::vector<launch> final_launches;
+    for(size_t j = 0; j < fans.size(); j++) {
+        final_launches.push_back({start, target, aim_at_elevation(start, target, velocity_init, fans[j].seed), bullet_mass,
+                                  options.curves != nullptr ? &(*options.curves)[first_curve + j] : nullptr, options.events, options.curve_tolerance, options.drag, options.compensated});
+    }
+    auto results = simulate_batch(final_launches, dt, options.limits, options.env);
+    release_curves(options);
+
+    std::vector<firing_solution> solutions;
+    for(size_t j = 0; j < fans.size(); j++) {
+        auto &result = results[j];
+        firing_solution solution{fans[j].arc, target, final_launches[j].vel, get_distance(result.closest, target), result.time_of_flight, result.reason, get_reached(result, start, target),
+                                 target, 1.0f, false, fans[j].shots + 1, std::move(result.events), {}, target};
+        solution.summary = summarize(final_launches[j], result, target);
+        solutions.push_back(std::move(solution));
+    }
+    return solutions;
+}
+
+
+/// @brief Find both direct and lofted firing solutions, each corrective shot simulates both arcs as one batch
+/// A moving target is led by the time of flight of the previous shot, so the time of flight converges together with the aim.
+/// @param start starting position
+/// @param target target position, ignored for a moving target
+/// @param velocity_init initial velocity of the bullet
+/// @param bullet_mass mass of the bullet
+/// @param options settings of the solver
+/// @return direct and lofted firing solution
+std::vector<firing_solution> solve_firing_solutions(position start, position target, float velocity_init, float bullet_mass, const solver_options &options) {
+    if(options.motion != nullptr) {
+        target = options.motion->origin;
+    }
+
+    std::vector<firing_solution> solutions;
+    if(options.fan_lanes > 0 && options.motion == nullptr) {
+        solutions = solve_by_fan(start, target, velocity_init, bullet_mass, options);
+        for(const auto &solution : solutions) {
+            if(options.log != nullptr) {
+                *options.log << "Fan " << get_arc_name(solution.arc) << " lanes: " << options.fan_lanes << "\tmin distance: " << solution.min_distance << " m\tlaunch angle: "
+                             << get_launch_angle(solution.vel)*RADIAN_TO_DEGREE << "°\ttime of flight: " << solution.time_of_flight << " s\tstopped: "
+                             << get_termination_name(solution.reason) << std::endl;
+            }
+        }
+        return solutions;
+    }
+
+    for(auto arc : {trajectory_arc::direct, trajectory_arc::lofted}) {
+        // start from the analytic solution without drag, a moving target is first led by its time of flight
+        float vh = get_optimal_horizontal_velocity(start, target, velocity_init, arc);
+        float time_of_flight = vh > 0 ? get_horizontal_distance(start, target)/vh : 0.0f;
+        solutions.push_back({arc, target, aim_with_gravity(start, target, velocity_init, arc), get_distance(start, target), time_of_flight, termination_reason::none, start, target, 1.0f, false, 0,
+                             {}, {}, target});
+    }
+
+    int shot_index = 0;
+    auto *curves = options.curves;
+    for(const auto &stage : options.stages) {
+        // closest positions from a different time step are not comparable
+        for(auto &solution : solutions) {
+            solution.has_previous = false;
+        }
+
+        for(int i = 0; i < stage.shots; i++, shot_index++) {
+            size_t first_curve = 0;
+            if(curves != nullptr) {
+                first_curve = curves->size();
+                curves->resize(first_curve + solutions.size());
+            }
+
+            std::vector<launch> launches;
+            simulation_limits limits = options.limits;
+            for(size_t j = 0; j < solutions.size(); j++) {
+                auto &solution = solutions[j];
+                if(options.motion != nullptr) {
+                    move_target(solution, start, predict_target(*options.motion, solution.time_of_flight), velocity_init);
+                    limits.floor = std::min(limits.floor, solution.target.y);
+                }
+                solution.vel = aim_with_gravity(start, solution.aim, velocity_init, solution.arc);
+                launches.push_back({start, solution.aim, solution.vel, bullet_mass, curves != nullptr ? &(*curves)[first_curve + j] : nullptr,
+                                    options.events, options.curve_tolerance, options.drag, options.compensated});
+            }
+            auto results = simulate_batch(launches, stage.dt, limits, options.env);
+            release_curves(options);
+
+            for(size_t j = 0; j < solutions.size(); j++) {
+                auto &solution = solutions[j];
+                correct_aim(solution, start, solution.target, velocity_init, results[j]);
+                solution.events = std::move(results[j].events);
+                solution.summary = summarize(launches[j], results[j], solution.target);
+                if(options.log != nullptr) {
+                    *options.log << "Shot " << shot_index << " " << get_arc_name(solution.arc) << " step: " << stage.dt << " s\tmin distance: " << solution.min_distance << " m\tlaunch angle: "
+                         << get_launch_angle(solution.vel)*RADIAN_TO_DEGREE << "°\ttime of flight: " << solution.time_of_flight << " s\tstopped: "
+                         << get_termination_name(solution.reason) << std::endl;
+                }
+            }
+        }
+    }
+    return solutions;
+}
+
+
+/// @brief Time steps chosen for projectile classes, a projectile class is given by mass, velocity, accuracy, drag and air
+/// The cache may be shared by threads solving different scenarios.
+struct time_step_cache {
+    struct entry {
+        float range; // longest horizontal range the time step was verified for
+        float dt;
+    };
+    std::map<std::tuple<float, float, float, uint64_t, uint64_t>, entry> entries;
+    std::mutex mutex;
+};
+
+
+/// @brief Hash of a drag curve, equal for equal tables so scenarios with the same bullet share time steps
+/// @param drag drag table, nullptr for the constant drag coefficient
+/// @return hash
+uint64_t get_drag_hash(const drag_table *drag) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    if(drag != nullptr) {
+        hash = add_to_hash(hash, &drag->step, sizeof(drag->step));
+        hash = add_to_hash(hash, drag->cd.data(), drag->cd.size()*sizeof(float));
+    }
+    return hash;
+}
+
+
+/// @brief Hash of the air around the bullets, equal for equal atmospheres and wind fields
+/// @param env air around the bullets
+/// @return hash
+uint64_t get_environment_hash(const environment &env) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    if(env.air != nullptr) {
+        hash = add_to_hash(hash, &env.air->min_height, sizeof(env.air->min_height));
+        hash = add_to_hash(hash, &env.air->step, sizeof(env.air->step));
+        hash = add_to_hash(hash, env.air->density.data(), env.air->density.size()*sizeof(float));
+        hash = add_to_hash(hash, env.air->speed_of_sound.data(), env.air->speed_of_sound.size()*sizeof(float));
+    }
+    // separates an atmosphere from a wind field
+    hash = add_to_hash(hash, "|", 1);
+    if(env.wind != nullptr) {
+        hash = add_to_hash(hash, &env.wind->hash, sizeof(env.wind->hash));
+    }
+    return hash;
+}
+
+
+/// @brief Choose the largest time step with position error at the target within tolerance
+/// Error of the time step is estimated by comparing to a simulation with half the step (Richardson),
+/// the integration is first order so the error of the larger step is twice the difference.
+/// @param start starting position
+/// @param target target position
+/// @param velocity_init initial velocity of the bullet
+/// @param bullet_mass mass of the bullet
+/// @param tolerance allowed position error at the target in meters
+/// @param cache optional cache of time steps chosen for projectile classes
+/// @param env air around the bullets
+/// @param drag drag coefficient of the bullet depending on Mach number
+/// @return time step in seconds
+/// @throws std::runtime_error when no time step within MAX_ITERATIONS steps per flight meets the tolerance
+float choose_time_step(position start, position target, float velocity_init, float bullet_mass, float tolerance, time_step_cache *cache = nullptr,
+                       const environment &env = {}, const drag_table *drag = nullptr) {
+    float range = get_horizontal_distance(start, target);
+    auto key = std::make_tuple(bullet_mass, velocity_init, tolerance, get_drag_hash(drag), get_environment_hash(env));
+    if(cache != nullptr) {
+        // error grows with the range, time step verified for a longer range is good enough
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto found = cache->entries.find(key);
+        if(found != cache->entries.end() && range <= found->second.range) {
+            return found->second.dt;
+        }
+    }
+
+    // estimate error of both arcs, the lofted one flies longer and is usually the limiting one
+    std::vector<launch> launches;
+    for(auto arc : {trajectory_arc::direct, trajectory_arc::lofted}) {
+        if(get_optimal_horizontal_velocity(start, target, velocity_init, arc) > 0) {
+            launches.push_back({start, target, aim_with_gravity(start, target, velocity_init, arc), bullet_mass, nullptr, nullptr, 0.0f, drag});
+        }
+    }
+
+    float dt = range/velocity_init/STEPS_PER_FLIGHT;
+    if(launches.empty()) {
+        return dt;
+    }
+    simulation_limits limits = get_default_limits(start, target);
+    auto results = simulate_batch(launches, dt, limits, env);
+    bool verified = false;
+    for(int i = 0; i < MAX_STEP_HALVINGS && !verified; i++) {
+        // flights cut short by the iteration limit are not comparable
+        float time_of_flight = 0.0f;
+        for(const auto &result : results) {
+            time_of_flight = std::max(time_of_flight, result.time_of_flight);
+        }
+        if(time_of_flight/(dt/2) >= MAX_ITERATIONS) {
+            break;
+        }
+        auto half_results = simulate_batch(launches, dt/2, limits, env);
+        float error = 0.0f;
+        for(size_t j = 0; j < results.size(); j++) {
+            error = std::max(error, 2*get_distance(results[j].impact, half_results[j].impact));
+        }
+        if(error <= tolerance) {
+            verified = true;
+            break;
+        }
+        dt /= 2;
+        results = half_results;
+    }
+    if(!verified) {
+        throw std::runtime_error("no time step meets the accuracy of " + std::to_string(tolerance) + " m");
+    }
+
+    if(cache != nullptr) {
+        // another thread may have verified a longer range meanwhile, the entry keeps the longest one
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto [found, inserted] = cache->entries.try_emplace(key, time_step_cache::entry{range, dt});
+        if(!inserted && range > found->second.range) {
+            found->second = {range, dt};
+        }
+    }
+    return dt;
+}
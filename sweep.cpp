@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <ostream>
+
+#include "simulation.cpp"
+
+const float SWEEP_AIM_DISTANCE = 1e6; // distance of the aim point along the line of fire, never reached
+const char RANGE_TABLE_MAGIC[4] = {'R', 'T', 'A', 'B'};
+
+/// @brief Grid of launch elevations and muzzle velocities, bounds are included
+struct sweep_grid {
+    float elevation_min; // degrees
+    float elevation_max;
+    float elevation_step;
+    float velocity_min; // m/s
+    float velocity_max;
+    float velocity_step;
+};
+
+/// @brief Row of a range table, shot over flat ground at the height of the start
+/// Angles are kept in the degrees of the grid, so they are written as given instead of going through radians and back.
+struct range_entry {
+    float elevation; // degrees
+    float velocity; // muzzle velocity in m/s
+    float range; // horizontal distance of the impact in meters
+    float max_ordinate; // highest point above the start in meters
+    float time_of_flight; // seconds
+    float impact_angle; // angle below horizontal in degrees
+    float impact_velocity; // m/s
+};
+
+
+/// @brief Values of one axis of the grid
+/// @param min first value
+/// @param max last value, included up to rounding
+/// @param step distance of values
+/// @return values from min to max
+std::vector<float> get_sweep_values(float min, float max, float step) {
+    std::vector<float> values;
+    int count = step > 0 ? static_cast<int>(std::floor((max - min)/step + 1e-3f)) + 1 : 1;
+    for(int i = 0; i < count; i++) {
+        // rounded once from double, so 10 + 3*0.1 is the float closest to 10.3
+        values.push_back(static_cast<float>(min + static_cast<double>(i)*step));
+    }
+    return values;
+}
+
+
+/// @brief Range table entry from the result of a shot along the x axis
+/// @param elevation launch elevation in degrees
+/// @param velocity_init muzzle velocity
+/// @param start starting position
+/// @param result result of the shot
+/// @return range table entry
+range_entry get_range_entry(float elevation, float velocity_init, position start, const shot_result &result) {
+    const auto &v = result.impact_velocity;
+    float horizontal = sqrt(v.dx*v.dx + v.dz*v.dz);
+    float speed = sqrt(v.dx*v.dx + v.dy*v.dy + v.dz*v.dz);
+    // impact is interpolated within the last step, where the bullet moves with the impact velocity
+    float time_of_flight = result.time_of_flight;
+    if(horizontal > 0) {
+        time_of_flight += get_horizontal_distance(result.closest, result.impact)/horizontal;
+    }
+    return {elevation, velocity_init, get_horizontal_distance(start, result.impact), result.apex - start.y, time_of_flight, std::atan2(-v.dy, horizontal)*RADIAN_TO_DEGREE, speed};
+}
+
+
+/// @brief Simulate shots over a grid of elevations and velocities, every velocity is one batch of all elevations
+/// Batches are taken by threads from a shared counter, entries are in the order of velocities and elevations.
+/// Shots stopped before they hit the ground, by MAX_ITERATIONS on long flights at a small step, have no entry.
+/// @param start starting position, ground is at its height
+/// @param grid elevations and velocities
+/// @param bullet_mass mass of the bullet
+/// @param dt time step in seconds
+/// @param threads number of threads, 0 uses all hardware threads
+/// @param env air around the bullets
+/// @param drag drag coefficient of the bullet depending on Mach number
+/// @return range table
+std::vector<range_entry> run_sweep(position start, const sweep_grid &grid, float bullet_mass, float dt, int threads = 0, const environment &env = {}, const drag_table *drag = nullptr) {
+    if(threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto elevations = get_sweep_values(grid.elevation_min, grid.elevation_max, grid.elevation_step);
+    auto velocities = get_sweep_values(grid.velocity_min, grid.velocity_max, grid.velocity_step);
+    std::vector<range_entry> table(elevations.size()*velocities.size());
+    std::vector<char> landed(table.size());
+
+    // shots fly along the x axis until they fall to the height of the start
+    position aim{start.x + SWEEP_AIM_DISTANCE, start.y, start.z};
+    simulation_limits limits;
+    limits.floor = start.y;
+    std::atomic<size_t> next_velocity{0};
+
+    auto worker = [&]() {
+        std::vector<launch> launches;
+        for(size_t i = next_velocity++; i < velocities.size(); i = next_velocity++) {
+            launches.clear();
+            for(float elevation : elevations) {
+                launches.push_back({start, aim, aim_at_elevation(start, aim, velocities[i], elevation*DEGREE_TO_RADIAN), bullet_mass, nullptr, nullptr, 0.0f, drag});
+            }
+            auto results = simulate_batch(launches, dt, limits, env);
+            for(size_t j = 0; j < elevations.size(); j++) {
+                table[i*elevations.size() + j] = get_range_entry(elevations[j], velocities[i], start, results[j]);
+                landed[i*elevations.size() + j] = results[j].reason == termination_reason::ground;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for(int i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(auto &thread : pool) {
+        thread.join();
+    }
+
+    size_t kept = 0;
+    for(size_t i = 0; i < table.size(); i++) {
+        if(landed[i]) {
+            table[kept++] = table[i];
+        }
+    }
+    table.resize(kept);
+    return table;
+}
+
+
+/// @brief Write range table as CSV
+/// @param out output stream
+/// @param table range table
+/// @param precision significant digits, negative for the shortest text that reads back the same value
+void write_range_table_csv(std::ostream &out, const std::vector<range_entry> &table, int precision = -1) {
+    output_buffer buffer = create_output_buffer(out, precision);
+    write_text(buffer, "elevation,velocity,range,max_ordinate,time_of_flight,impact_angle,impact_velocity\n");
+    for(const auto &e : table) {
+        write_csv_row(buffer, e.elevation, e.velocity, e.range, e.max_ordinate, e.time_of_flight, e.impact_angle, e.impact_velocity);
+    }
+    flush_buffer(buffer);
+}
+
+
+/// @brief Write range table in binary, "RTAB", uint32 number of entries and 7 floats per entry as in range_entry, angles in degrees
+/// @param out output stream opened in binary mode
+/// @param table range table
+void write_range_table_binary(std::ostream &out, const std::vector<range_entry> &table) {
+    static_assert(sizeof(range_entry) == 7*sizeof(float), "range entry is written as packed floats");
+    uint32_t count = static_cast<uint32_t>(table.size());
+    out.write(RANGE_TABLE_MAGIC, sizeof(RANGE_TABLE_MAGIC));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char *>(table.data()), table.size()*sizeof(range_entry));
+}
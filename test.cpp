@@ -1,7 +1,16 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
 
 #include "simulation.cpp"
+#include "dispersion.cpp"
+#include "tracking.cpp"
+#include "sweep.cpp"
+#include "batch.cpp"
+#include "json_output.cpp"
+#include "trajectory_store.cpp"
 
 entt::registry create_registry_with_bullet(){
     entt::registry registry;
@@ -62,6 +71,48 @@ TEST_CASE("Bullet acceleration is updated", "[update_acceleration]") {
     });
 }
 
+TEST_CASE("Force model contains only its terms", "[update_acceleration]") {
+    entt::registry registry = create_registry_with_bullet();
+    update_acceleration<force_model<gravity_force>>(registry);
+    const auto &acc = registry.get<acceleration>(registry.view<acceleration>().front());
+    REQUIRE(acc.ddx == 0.0f);
+    REQUIRE(acc.ddy == -GRAVITY);
+
+    // same result as the runtime selection for still air of constant density
+    update_acceleration<force_model<gravity_force, quadratic_drag<constant_density, still_air>>>(registry);
+    float drag = acc.ddx;
+    update_acceleration(registry);
+    REQUIRE(acc.ddx == drag);
+    REQUIRE(select_acceleration_system(environment{}) == &update_acceleration<force_model<gravity_force, quadratic_drag<constant_density, still_air>>>);
+}
+
+TEST_CASE("Compensated float integration matches double", "[update_position]") {
+    entt::registry registry;
+    entt::entity plain = registry.create();
+    entt::entity compensated = registry.create();
+    for(auto entity : {plain, compensated}) {
+        registry.emplace<position>(entity, 100.0f, 0.0f, 0.0f);
+        registry.emplace<velocity>(entity, 301.3f, 20.7f, 0.0f);
+        registry.emplace<acceleration>(entity, -3.1f, -GRAVITY, 0.0f);
+    }
+    registry.emplace<compensation>(compensated);
+
+    // the same steps in double
+    const double dt = 0.001f;
+    double x = 100.0;
+    double dx = 301.3f;
+    for(int i = 0; i < MAX_ITERATIONS; i++) {
+        update_velocity(registry, 0.001f);
+        update_position(registry, 0.001f);
+        dx += -3.1f*dt;
+        x += dx*dt;
+    }
+    double plain_error = std::abs(registry.get<position>(plain).x - x);
+    double compensated_error = std::abs(registry.get<position>(compensated).x - x);
+    REQUIRE(compensated_error < 0.001);
+    REQUIRE(compensated_error*10 < plain_error);
+}
+
 TEST_CASE("Bullet x speed goes down", "[update]") {
     entt::registry registry = create_registry_with_bullet();
     float prev_dx = 2.0f;
@@ -132,9 +183,795 @@ TEST_CASE("Bullet is not behind target", "[is_behind]"){
     REQUIRE_FALSE(is_behind(pos, start, target));
 }
 
+TEST_CASE("Sideways drift does not pass the target", "[is_behind]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{10.0f, 0.0f, 0.0f};
+    // far to the side but short of the target plane, the old per axis check stopped it
+    REQUIRE_FALSE(is_behind({5.0f, 0.0f, 3.0f}, start, target));
+    REQUIRE_FALSE(is_behind({5.0f, 0.0f, -3.0f}, start, target));
+    REQUIRE(is_behind({10.5f, 0.0f, 3.0f}, start, target));
+    // diagonal line of fire, the plane is perpendicular to it
+    position diagonal{10.0f, 0.0f, 10.0f};
+    REQUIRE_FALSE(is_behind({12.0f, 0.0f, 7.0f}, start, diagonal));
+    REQUIRE(is_behind({12.0f, 0.0f, 9.0f}, start, diagonal));
+}
+
 TEST_CASE("Get launch angle", "[get_launch_angle]") {
     position start{0.0f, 0.0f, 0.0f};
     position target{1.0f, 1.0f, 0.0f};
     // angle should be 45°
     REQUIRE_THAT(get_launch_angle(start, target), Catch::Matchers::WithinAbs(0.785398163f, 0.1f));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Lofted arc is slower horizontally", "[get_optimal_horizontal_velocity]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 0.0f, 0.0f};
+    float direct = get_optimal_horizontal_velocity(start, target, 30.0f, trajectory_arc::direct);
+    float lofted = get_optimal_horizontal_velocity(start, target, 30.0f, trajectory_arc::lofted);
+    REQUIRE(direct > 0);
+    REQUIRE(lofted > 0);
+    REQUIRE(lofted < direct);
+}
+
+TEST_CASE("Batch lanes match single simulations", "[simulate_batch]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    velocity direct = aim_with_gravity(start, target, 30.0f, trajectory_arc::direct);
+    velocity lofted = aim_with_gravity(start, target, 30.0f, trajectory_arc::lofted);
+    auto results = simulate_batch({{start, target, direct, 0.05f}, {start, target, lofted, 0.05f}}, 0.01f);
+    REQUIRE(results.size() == 2);
+
+    position closest_direct = simulate(start, target, 0.01f, 0.05f, direct, nullptr);
+    position closest_lofted = simulate(start, target, 0.01f, 0.05f, lofted, nullptr);
+    REQUIRE(results[0].closest.y == closest_direct.y);
+    REQUIRE(results[1].closest.y == closest_lofted.y);
+    REQUIRE(results[1].time_of_flight > results[0].time_of_flight);
+}
+
+TEST_CASE("Crossing of the target plane", "[get_crossing_fraction]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{2.0f, 0.0f, 0.0f};
+    position a{1.0f, 1.0f, 0.0f};
+    position b{3.0f, 0.0f, 0.0f};
+    float fraction = get_crossing_fraction(a, b, start, target);
+    REQUIRE_THAT(fraction, Catch::Matchers::WithinAbs(0.5f, 0.0001f));
+    REQUIRE_THAT(interpolate(a, b, fraction).y, Catch::Matchers::WithinAbs(0.5f, 0.0001f));
+}
+
+TEST_CASE("Coarse stage followed by fine stage hits target", "[solve_firing_solutions]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    solver_options options = get_default_options(start, target, 0.01f);
+    options.stages = {{0.1f, 4}, {0.01f, 2}};
+    auto solutions = solve_firing_solutions(start, target, 30.0f, 0.05f, options);
+    REQUIRE(solutions.size() == 2);
+    REQUIRE(solutions[0].arc == trajectory_arc::direct);
+    REQUIRE(solutions[1].arc == trajectory_arc::lofted);
+    REQUIRE(solutions[0].min_distance < 0.1f);
+    REQUIRE(solutions[1].min_distance < 0.1f);
+    REQUIRE(get_launch_angle(solutions[1].vel) > get_launch_angle(solutions[0].vel));
+}
+
+TEST_CASE("Chosen time step meets accuracy and is cached", "[choose_time_step]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    time_step_cache cache;
+    float dt = choose_time_step(start, target, 30.0f, 0.05f, 0.05f, &cache);
+    velocity vel = aim_with_gravity(start, target, 30.0f);
+    position coarse = simulate(start, target, dt, 0.05f, vel, nullptr);
+    position fine = simulate(start, target, dt/4, 0.05f, vel, nullptr);
+    REQUIRE(get_distance(coarse, fine) < 0.05f);
+    REQUIRE(cache.entries.size() == 1);
+
+    // shorter range reuses the cached step
+    position closer{20.0f, 1.0f, 20.0f};
+    REQUIRE(choose_time_step(start, closer, 30.0f, 0.05f, 0.05f, &cache) == dt);
+
+    // another drag curve is another projectile class
+    drag_table g7 = create_drag_table(G7_DRAG);
+    choose_time_step(start, target, 30.0f, 0.05f, 0.05f, &cache, {}, &g7);
+    REQUIRE(cache.entries.size() == 2);
+
+    // wind fields are told apart by the hash computed when they are created
+    const float origin[3] = {0.0f, 0.0f, 0.0f};
+    const float spacing[3] = {10.0f, 10.0f, 10.0f};
+    wind_field calm = create_wind_field(2, 2, 2, origin, spacing, std::vector<wind_vector>(8, wind_vector{0.0f, 0.0f, 0.0f}));
+    wind_field still = create_wind_field(2, 2, 2, origin, spacing, std::vector<wind_vector>(8, wind_vector{0.0f, 0.0f, 0.0f}));
+    wind_field breeze = create_wind_field(2, 2, 2, origin, spacing, std::vector<wind_vector>(8, wind_vector{0.0f, 0.0f, 1.0f}));
+    environment calm_env;
+    calm_env.wind = &calm;
+    environment still_env;
+    still_env.wind = &still;
+    environment breeze_env;
+    breeze_env.wind = &breeze;
+    REQUIRE(get_environment_hash(calm_env) == get_environment_hash(still_env));
+    REQUIRE(get_environment_hash(calm_env) != get_environment_hash(breeze_env));
+    REQUIRE(get_environment_hash(calm_env) != get_environment_hash(environment{}));
+
+    // accuracy that needs more steps than a flight may take is an error
+    REQUIRE_THROWS_AS(choose_time_step(start, target, 30.0f, 0.05f, 1e-9f), std::runtime_error);
+}
+
+TEST_CASE("Bullet falling short stops at the floor", "[simulate_batch]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{100.0f, 0.0f, 0.0f};
+    simulation_limits limits;
+    limits.floor = 0.0f;
+    auto results = simulate_batch({{start, target, {10.0f, 5.0f, 0.0f}, 0.05f}}, 0.01f, limits);
+    REQUIRE(results[0].reason == termination_reason::ground);
+    REQUIRE_THAT(results[0].impact.y, Catch::Matchers::WithinAbs(0.0f, 0.0001f));
+    REQUIRE(results[0].impact.x < 10.0f);
+}
+
+TEST_CASE("Bullet stops on time and bounds limits", "[simulate_batch]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{100.0f, 0.0f, 0.0f};
+    simulation_limits limits;
+    limits.max_time = 0.5f;
+    auto results = simulate_batch({{start, target, {10.0f, 5.0f, 0.0f}, 0.05f}}, 0.01f, limits);
+    REQUIRE(results[0].reason == termination_reason::max_time);
+
+    limits = simulation_limits();
+    limits.bounds_max.x = 2.0f;
+    results = simulate_batch({{start, target, {10.0f, 5.0f, 0.0f}, 0.05f}}, 0.01f, limits);
+    REQUIRE(results[0].reason == termination_reason::out_of_bounds);
+    REQUIRE(results[0].impact.x > 2.0f);
+}
+
+TEST_CASE("Apex is located between time steps", "[update_events]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{100.0f, 0.0f, 0.0f};
+    std::vector<event> events{apex_event()};
+    auto coarse = simulate_batch({{start, target, {10.0f, 10.0f, 0.0f}, 1000.0f, nullptr, &events}}, 0.1f);
+    auto fine = simulate_batch({{start, target, {10.0f, 10.0f, 0.0f}, 1000.0f, nullptr, &events}}, 0.001f);
+    REQUIRE(coarse[0].events.size() == 1);
+    REQUIRE_THAT(coarse[0].events[0].vel.dy, Catch::Matchers::WithinAbs(0.0f, 0.0001f));
+    // heavy bullet has negligible drag, apex at v/g
+    REQUIRE_THAT(fine[0].events[0].time, Catch::Matchers::WithinAbs(10.0f/GRAVITY, 0.01f));
+    REQUIRE_THAT(fine[0].events[0].pos.y, Catch::Matchers::WithinAbs(100.0f/(2*GRAVITY), 0.05f));
+}
+
+TEST_CASE("Terminal height event stops the bullet at the height", "[update_events]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{100.0f, 0.0f, 0.0f};
+    std::vector<event> events{height_event(-1.0f), plane_event({5.0f, 0.0f, 0.0f}, {1.0f, 0.0f, 0.0f})};
+    auto results = simulate_batch({{start, target, {10.0f, 5.0f, 0.0f}, 0.05f, nullptr, &events}}, 0.05f);
+    REQUIRE(results[0].reason == termination_reason::event);
+    REQUIRE_THAT(results[0].impact.y, Catch::Matchers::WithinAbs(-1.0f, 0.0001f));
+    REQUIRE(results[0].events.size() == 2);
+    REQUIRE(results[0].events[0].event == 1);
+    REQUIRE_THAT(results[0].events[0].pos.x, Catch::Matchers::WithinAbs(5.0f, 0.0001f));
+    REQUIRE(results[0].events[1].event == 0);
+}
+
+TEST_CASE("Summary is accumulated without history", "[summarize]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    launch l{start, target, aim_with_gravity(start, target, 30.0f), 0.05f};
+    auto results = simulate_batch({l}, 0.01f);
+    trajectory_summary summary = summarize(l, results[0], target);
+    REQUIRE(summary.apex > target.y);
+    REQUIRE(summary.time_of_flight > 0.0f);
+    REQUIRE(summary.impact_energy > 0.0f);
+    // drag takes energy
+    REQUIRE(summary.impact_energy < 0.5f*0.05f*30.0f*30.0f);
+    REQUIRE_THAT(summary.launch_angle, Catch::Matchers::WithinAbs(get_launch_angle(l.vel), 0.0001f));
+}
+
+TEST_CASE("Straight line is decimated to its ends", "[record_position]") {
+    std::vector<position> points;
+    history_recorder recorder{&points, 0.001f};
+    for(int i = 0; i <= 100; i++) {
+        record_position(recorder, {i*1.0f, i*0.5f, 0.0f});
+    }
+    REQUIRE(points.size() == 1);
+    REQUIRE(recorder.pending.size() == 100);
+}
+
+TEST_CASE("Decimated history stays within tolerance", "[simulate_batch]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    velocity vel = aim_with_gravity(start, target, 30.0f);
+    std::vector<position> full;
+    std::vector<position> decimated;
+    simulate_batch({{start, target, vel, 0.05f, &full}, {start, target, vel, 0.05f, &decimated, nullptr, 0.01f}}, 0.01f);
+    REQUIRE(decimated.size() * 5 < full.size());
+    REQUIRE(decimated.front().x == full.front().x);
+    REQUIRE(decimated.back().x == full.back().x);
+
+    for(const auto &p : full) {
+        float distance = std::numeric_limits<float>::infinity();
+        for(size_t i = 1; i < decimated.size(); i++) {
+            distance = std::min(distance, get_segment_distance(p, decimated[i - 1], decimated[i]));
+        }
+        REQUIRE(distance <= 0.0101f);
+    }
+}
+
+TEST_CASE("Counter based random numbers are normal", "[random_normal]") {
+    double sum = 0, sum2 = 0;
+    const int n = 100000;
+    for(int i = 0; i < n; i++) {
+        float x = random_normal(7, i);
+        sum += x;
+        sum2 += x*x;
+    }
+    REQUIRE_THAT(sum/n, Catch::Matchers::WithinAbs(0.0, 0.02));
+    REQUIRE_THAT(sum2/n, Catch::Matchers::WithinAbs(1.0, 0.02));
+    REQUIRE(random_normal(7, 42) == random_normal(7, 42));
+}
+
+TEST_CASE("Monte Carlo does not depend on thread count", "[run_monte_carlo]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    velocity vel = aim_with_gravity(start, target, 30.0f);
+    dispersion_model model{0.5f, 0.001f, 0.002f, 0.002f, 0.02f};
+    auto one = run_monte_carlo(start, target, vel, 0.05f, 0.01f, model, 0.5f, 5000, 3, 1);
+    auto four = run_monte_carlo(start, target, vel, 0.05f, 0.01f, model, 0.5f, 5000, 3, 4);
+    REQUIRE(one.cep == four.cep);
+    REQUIRE(one.mean_vertical == four.mean_vertical);
+    REQUIRE(one.hit_probability == four.hit_probability);
+    REQUIRE(one.sd_lateral > 0.0f);
+    REQUIRE(one.cep > 0.0f);
+
+    dispersion_model exact{0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    auto none = run_monte_carlo(start, target, vel, 0.05f, 0.01f, exact, 0.5f, 100, 3);
+    REQUIRE(none.sd_vertical < 0.0001f);
+}
+
+TEST_CASE("Cholesky factor reproduces the matrix", "[cholesky]") {
+    parameter_covariance matrix{{{4.0f, 2.0f, 0.0f, 0.0f}, {2.0f, 5.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 0.0f}}};
+    parameter_covariance factor = cholesky(matrix);
+    for(int i = 0; i < UNCERTAIN_PARAMETERS; i++) {
+        for(int j = 0; j < UNCERTAIN_PARAMETERS; j++) {
+            float sum = 0.0f;
+            for(int k = 0; k < UNCERTAIN_PARAMETERS; k++) {
+                sum += factor[i][k]*factor[j][k];
+            }
+            REQUIRE_THAT(sum, Catch::Matchers::WithinAbs(matrix[i][j], 0.0001f));
+        }
+    }
+}
+
+TEST_CASE("Unscented transform agrees with Monte Carlo", "[propagate_uncertainty]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    velocity vel = aim_with_gravity(start, target, 30.0f);
+    dispersion_model model{0.5f, 0.002f, 0.002f, 0.002f, 0.0f};
+    parameter_covariance covariance{};
+    covariance[0][0] = model.velocity_sd*model.velocity_sd;
+    covariance[1][1] = model.mass_sd*model.mass_sd;
+    covariance[2][2] = model.elevation_sd*model.elevation_sd;
+    covariance[3][3] = model.azimuth_sd*model.azimuth_sd;
+
+    auto unscented = propagate_uncertainty(start, target, vel, 0.05f, 0.01f, covariance);
+    auto monte_carlo = run_monte_carlo(start, target, vel, 0.05f, 0.01f, model, 0.5f, 20000, 5);
+    REQUIRE_THAT(sqrt(unscented.var_vertical), Catch::Matchers::WithinRel(monte_carlo.sd_vertical, 0.1f));
+    REQUIRE_THAT(sqrt(unscented.var_lateral), Catch::Matchers::WithinRel(monte_carlo.sd_lateral, 0.1f));
+    REQUIRE(unscented.ellipse_major >= unscented.ellipse_minor);
+}
+
+TEST_CASE("Standard atmosphere density", "[get_air_density]") {
+    atmosphere air = create_standard_atmosphere();
+    REQUIRE_THAT(get_air_density(air, 0.0f), Catch::Matchers::WithinAbs(1.225f, 0.001f));
+    REQUIRE_THAT(get_air_density(air, 5000.0f), Catch::Matchers::WithinAbs(0.7364f, 0.001f));
+    REQUIRE_THAT(get_air_density(air, 15000.0f), Catch::Matchers::WithinAbs(0.1948f, 0.002f));
+    // interpolated between table entries
+    REQUIRE_THAT(get_air_density(air, 1234.5f), Catch::Matchers::WithinAbs(get_isa_density(1234.5f, 0.0f, SEA_LEVEL_TEMPERATURE, SEA_LEVEL_PRESSURE), 0.0001f));
+}
+
+TEST_CASE("Thin air at altitude reduces drag", "[update_acceleration]") {
+    entt::registry registry = create_registry_with_bullet();
+    update_acceleration(registry);
+    float sea_level_drag = registry.get<acceleration>(registry.view<acceleration>().front()).ddx;
+
+    atmosphere air = create_atmosphere(3000.0f, 0.0f, 70000.0f);
+    environment env;
+    env.air = &air;
+    registry.ctx().emplace<environment>(env);
+    update_acceleration(registry);
+    float mountain_drag = registry.get<acceleration>(registry.view<acceleration>().front()).ddx;
+    REQUIRE(mountain_drag < 0.0f);
+    REQUIRE(mountain_drag > sea_level_drag);
+}
+
+TEST_CASE("Resampled drag table matches the standard curve", "[get_drag_coefficient]") {
+    drag_table g7 = create_drag_table(G7_DRAG);
+    REQUIRE_THAT(get_drag_coefficient(g7, 0.0f), Catch::Matchers::WithinAbs(0.1198f, 0.0001f));
+    REQUIRE_THAT(get_drag_coefficient(g7, 1.0f), Catch::Matchers::WithinAbs(0.3803f, 0.0001f));
+    REQUIRE_THAT(get_drag_coefficient(g7, 2.025f), Catch::Matchers::WithinAbs((0.2980f + 0.2951f)/2, 0.0001f));
+    // constant past the end of the table
+    REQUIRE_THAT(get_drag_coefficient(g7, 9.0f), Catch::Matchers::WithinAbs(0.1618f, 0.0001f));
+
+    drag_table scaled = create_drag_table(G1_DRAG, 2.0f);
+    REQUIRE_THAT(get_drag_coefficient(scaled, 1.0f), Catch::Matchers::WithinAbs(2*0.4805f, 0.0001f));
+
+    // user curves have to be non-empty and sorted
+    REQUIRE_THROWS_AS(create_drag_table({}), std::runtime_error);
+    REQUIRE_THROWS_AS(create_drag_table({{0.0f, 0.3f}, {1.0f, 0.4f}, {0.5f, 0.35f}}), std::runtime_error);
+    REQUIRE_THROWS_AS(create_drag_table({{0.0f, 0.3f}, {0.0f, 0.4f}}), std::runtime_error);
+}
+
+TEST_CASE("Drag rises through the sound barrier", "[update_acceleration]") {
+    drag_table g1 = create_drag_table(G1_DRAG);
+    entt::registry registry;
+    std::vector<entt::entity> entities;
+    for(float speed : {200.0f, 400.0f}) {
+        const auto entity = registry.create();
+        entities.push_back(entity);
+        registry.emplace<position>(entity, 0.0f, 0.0f, 0.0f);
+        registry.emplace<velocity>(entity, speed, 0.0f, 0.0f);
+        registry.emplace<acceleration>(entity, 0.0f, 0.0f, 0.0f);
+        registry.emplace<mass>(entity, 0.01f);
+        registry.emplace<drag_curve>(entity, &g1);
+    }
+    update_acceleration(registry);
+    std::vector<float> drag_per_speed2;
+    for(auto entity : entities) {
+        const auto &vel = registry.get<velocity>(entity);
+        drag_per_speed2.push_back(-registry.get<acceleration>(entity).ddx/(vel.dx*vel.dx));
+    }
+    // drag coefficient at Mach 1.18 is about three times the one at Mach 0.59
+    REQUIRE(drag_per_speed2[1] > 2.5f*drag_per_speed2[0]);
+}
+
+TEST_CASE("Wind field is trilinearly interpolated", "[sample_wind]") {
+    // wind linear in position is reproduced exactly, across bricks as well
+    const int nx = 11, ny = 6, nz = 9;
+    float origin[3] = {-10.0f, 0.0f, 5.0f};
+    float spacing[3] = {2.0f, 1.0f, 3.0f};
+    std::vector<wind_vector> linear;
+    for(int z = 0; z < nz; z++) {
+        for(int y = 0; y < ny; y++) {
+            for(int x = 0; x < nx; x++) {
+                float px = origin[0] + x*spacing[0];
+                float py = origin[1] + y*spacing[1];
+                float pz = origin[2] + z*spacing[2];
+                linear.push_back({px + 2*py, 0.5f*pz, py - pz});
+            }
+        }
+    }
+    wind_field field = create_wind_field(nx, ny, nz, origin, spacing, linear);
+    for(float x : {-10.0f, -3.3f, 1.0f, 9.9f}) {
+        for(float z : {5.0f, 17.2f, 28.9f}) {
+            wind_vector w = sample_wind(field, x, 2.7f, z);
+            REQUIRE_THAT(w.u, Catch::Matchers::WithinAbs(x + 2*2.7f, 0.001f));
+            REQUIRE_THAT(w.v, Catch::Matchers::WithinAbs(0.5f*z, 0.001f));
+            REQUIRE_THAT(w.w, Catch::Matchers::WithinAbs(2.7f - z, 0.001f));
+        }
+    }
+    // outside the grid the boundary value is used
+    REQUIRE_THAT(sample_wind(field, 100.0f, 2.7f, 5.0f).u, Catch::Matchers::WithinAbs(10.0f + 2*2.7f, 0.001f));
+
+    auto path = (std::filesystem::temp_directory_path() / "test_wind.bin").string();
+    save_wind_field(path, nx, ny, nz, origin, spacing, linear);
+    wind_field loaded = load_wind_field(path);
+    REQUIRE(sample_wind(loaded, 1.0f, 2.7f, 17.2f).u == sample_wind(field, 1.0f, 2.7f, 17.2f).u);
+
+    // node counts larger than the file are rejected before anything is allocated
+    save_wind_field(path, 60000, 60000, 60000, origin, spacing, linear);
+    REQUIRE_THROWS_AS(load_wind_field(path), std::runtime_error);
+    save_wind_field(path, 1, ny, nz, origin, spacing, linear);
+    REQUIRE_THROWS_AS(load_wind_field(path), std::runtime_error);
+    std::filesystem::remove(path);
+
+    const float flat[3] = {1.0f, 0.0f, 1.0f};
+    REQUIRE_THROWS_AS(create_wind_field(nx, ny, nz, origin, flat, linear), std::runtime_error);
+    const float infinite[3] = {1.0f, INFINITY, 1.0f};
+    REQUIRE_THROWS_AS(create_wind_field(nx, ny, nz, origin, infinite, linear), std::runtime_error);
+}
+
+TEST_CASE("Cross wind drifts the bullet", "[simulate_batch]") {
+    float origin[3] = {-100.0f, -100.0f, -100.0f};
+    float spacing[3] = {200.0f, 200.0f, 200.0f};
+    std::vector<wind_vector> linear(8, wind_vector{0.0f, 0.0f, 5.0f});
+    wind_field field = create_wind_field(2, 2, 2, origin, spacing, linear);
+    environment env;
+    env.wind = &field;
+
+    position start{0.0f, 0.0f, 0.0f};
+    position target{50.0f, 0.0f, 0.0f};
+    velocity vel = aim_with_gravity(start, target, 30.0f);
+    auto still = simulate_batch({{start, target, vel, 0.05f}}, 0.01f);
+    auto windy = simulate_batch({{start, target, vel, 0.05f}}, 0.01f, {}, env);
+    REQUIRE(still[0].closest.z == 0.0f);
+    REQUIRE(windy[0].closest.z > 0.1f);
+    REQUIRE_THAT(windy[0].closest.x, Catch::Matchers::WithinAbs(50.0f, 0.001f));
+}
+
+TEST_CASE("Moving target is led by the time of flight", "[solve_firing_solutions]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    target_motion motion{target, {-1.0f, 0.2f, 1.5f}, {0.0f, 0.0f, 0.0f}};
+    solver_options options = get_default_options(start, target, 0.001f);
+    auto stationary = solve_firing_solutions(start, target, 30.0f, 0.05f, options);
+    options.motion = &motion;
+    auto moving = solve_firing_solutions(start, target, 30.0f, 0.05f, options);
+
+    for(size_t i = 0; i < moving.size(); i++) {
+        // the bullet meets the target where the target is at the time of flight
+        REQUIRE(moving[i].min_distance < 0.1f);
+        REQUIRE(get_distance(moving[i].target, predict_target(motion, moving[i].time_of_flight)) < 0.1f);
+        REQUIRE(get_distance(moving[i].target, target) > 1.0f);
+        REQUIRE(moving[i].shots == stationary[i].shots);
+    }
+}
+
+TEST_CASE("Tracker needs one simulation per update in the steady state", "[update_tracker]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    solver_options options = get_default_options(start, target, 0.001f);
+    tracker t = create_tracker(start, 30.0f, 0.05f, options);
+
+    REQUIRE(update_tracker(t, target).cold);
+    int shots = 0;
+    for(int i = 1; i <= 50; i++) {
+        // target moving at 2 m/s, updated at 50 Hz
+        position moved{target.x - 0.03f*i, target.y + 0.01f*i, target.z + 0.03f*i};
+        auto update = update_tracker(t, moved);
+        REQUIRE_FALSE(update.cold);
+        REQUIRE(update.min_distance <= 0.05f);
+        shots += update.shots;
+    }
+    REQUIRE(shots <= 55);
+}
+
+TEST_CASE("Fan of elevations brackets both arcs", "[solve_by_fan]") {
+    position start{0.0f, 0.0f, 0.0f};
+    position target{40.0f, 1.0f, 45.0f};
+    solver_options options = get_default_options(start, target, 0.001f);
+    auto corrected = solve_firing_solutions(start, target, 30.0f, 0.05f, options);
+    options.fan_lanes = 8;
+    auto fan = solve_firing_solutions(start, target, 30.0f, 0.05f, options);
+
+    for(size_t i = 0; i < fan.size(); i++) {
+        REQUIRE(fan[i].arc == corrected[i].arc);
+        REQUIRE(fan[i].min_distance < 0.01f);
+        REQUIRE_THAT(get_launch_angle(fan[i].vel)*RADIAN_TO_DEGREE, Catch::Matchers::WithinAbs(get_launch_angle(corrected[i].vel)*RADIAN_TO_DEGREE, 0.05f));
+        // fewer batches one after another than corrective shots
+        REQUIRE(fan[i].shots < corrected[i].shots);
+    }
+
+    // target straight above has no horizontal direction
+    velocity up = aim_at_elevation(start, {0.0f, 10.0f, 0.0f}, 30.0f, 1.0f);
+    REQUIRE(std::isfinite(up.dx));
+    REQUIRE(std::isfinite(up.dz));
+    REQUIRE_THAT(get_launch_angle(up), Catch::Matchers::WithinAbs(1.0f, 0.0001f));
+}
+
+TEST_CASE("Finished bullets are removed from the systems", "[remove_finished]") {
+    position start{0.0f, 0.0f, 0.0f};
+    std::vector<launch> launches;
+    for(float range : {10.0f, 80.0f, 20.0f, 60.0f}) {
+        position target{range, 0.0f, 0.0f};
+        launches.push_back({start, target, aim_with_gravity(start, target, 40.0f), 1.0f});
+    }
+    // a volley of mixed ranges gives the same results as separate shots
+    auto volley = simulate_batch(launches, 0.01f);
+    for(size_t i = 0; i < launches.size(); i++) {
+        auto single = simulate_batch({launches[i]}, 0.01f);
+        REQUIRE(volley[i].closest.x == single[0].closest.x);
+        REQUIRE(volley[i].closest.y == single[0].closest.y);
+        REQUIRE(volley[i].time_of_flight == single[0].time_of_flight);
+    }
+
+    entt::registry registry;
+    for(int i = 0; i < 3; i++) {
+        auto entity = registry.create();
+        registry.emplace<position>(entity, 0.0f, 0.0f, 0.0f);
+        registry.emplace<velocity>(entity, 1.0f, 0.0f, 0.0f);
+        registry.emplace<acceleration>(entity, 0.0f, 0.0f, 0.0f);
+        shot s{};
+        s.reason = i == 1 ? termination_reason::passed_target : termination_reason::none;
+        registry.emplace<shot>(entity, s);
+    }
+    remove_finished(registry);
+    REQUIRE(registry.storage<velocity>().size() == 2);
+    REQUIRE(registry.storage<acceleration>().size() == 2);
+    REQUIRE(registry.storage<shot>().size() == 3);
+}
+
+TEST_CASE("Range table matches single shots and drag favours low elevations", "[run_sweep]") {
+    position start{0.0f, 0.0f, 0.0f};
+    sweep_grid grid{10.0f, 60.0f, 5.0f, 20.0f, 40.0f, 10.0f};
+    auto table = run_sweep(start, grid, 0.05f, 0.001f, 2);
+    REQUIRE(table.size() == 11*3);
+
+    // without drag the range would be symmetric around 45 degrees, drag favours the lower elevation
+    auto row = std::vector<range_entry>(table.begin() + 22, table.end());
+    REQUIRE(row[0].velocity == 40.0f);
+    auto longest = std::max_element(row.begin(), row.end(), [](const auto &a, const auto &b) { return a.range < b.range; });
+    REQUIRE(longest->elevation <= 45.0f);
+    REQUIRE(row[6].elevation == 40.0f);
+    REQUIRE(row[6].range > row[8].range);
+
+    const auto &entry = table[1];
+    position aim{SWEEP_AIM_DISTANCE, 0.0f, 0.0f};
+    simulation_limits limits;
+    limits.floor = 0.0f;
+    auto result = simulate_batch({{start, aim, aim_at_elevation(start, aim, entry.velocity, entry.elevation*DEGREE_TO_RADIAN), 0.05f}}, 0.001f, limits)[0];
+    REQUIRE(result.reason == termination_reason::ground);
+    REQUIRE(entry.range == result.impact.x);
+    REQUIRE(entry.max_ordinate == result.apex);
+    REQUIRE(entry.impact_angle > entry.elevation); // descent is steeper with drag
+    REQUIRE(entry.impact_velocity < entry.velocity);
+
+    // elevations are written as given in degrees
+    std::ostringstream csv;
+    write_range_table_csv(csv, table);
+    REQUIRE(csv.str().find("\n15,20,") != std::string::npos);
+    REQUIRE(get_sweep_values(10.0f, 11.0f, 0.1f)[3] == 10.3f);
+
+    // flights longer than MAX_ITERATIONS steps never land and are left out
+    float small_step = 2e-4f;
+    auto partial = run_sweep(start, grid, 0.05f, small_step, 2);
+    REQUIRE(partial.size() < table.size());
+    REQUIRE(!partial.empty());
+    for(const auto &e : partial) {
+        REQUIRE(e.time_of_flight <= (MAX_ITERATIONS + 1)*small_step);
+    }
+}
+
+TEST_CASE("Batch scenarios are streamed with defaults", "[read_scenarios]") {
+    std::istringstream document(R"({"defaults": {"mass": 0.05, "atmosphere": {"altitude": 100}}, "scenarios": [{"velocity": 30}, {"mass": 0.1, "atmosphere": {"temperature": 5}}]})");
+    std::vector<nlohmann::json> scenarios;
+    read_scenarios(document, false, [&scenarios](nlohmann::json scenario) {
+        scenarios.push_back(std::move(scenario));
+    });
+    REQUIRE(scenarios.size() == 2);
+    REQUIRE(scenarios[0]["mass"] == 0.05);
+    REQUIRE(scenarios[0]["velocity"] == 30);
+    REQUIRE(scenarios[1]["mass"] == 0.1);
+    REQUIRE(scenarios[1]["atmosphere"]["altitude"] == 100);
+    REQUIRE(scenarios[1]["atmosphere"]["temperature"] == 5);
+
+    std::istringstream lines("{\"defaults\": {\"mass\": 0.05}}\n{\"velocity\": 30}\n\n{\"defaults\": {\"mass\": 0.2}}\n{\"velocity\": 40}\n");
+    scenarios.clear();
+    read_scenarios(lines, true, [&scenarios](nlohmann::json scenario) {
+        scenarios.push_back(std::move(scenario));
+    });
+    REQUIRE(scenarios.size() == 2);
+    REQUIRE(scenarios[0]["mass"] == 0.05);
+    REQUIRE(scenarios[1]["mass"] == 0.2);
+    REQUIRE(scenarios[1]["velocity"] == 40);
+
+    // a broken line is reported in place of its scenario and the lines after it are still read
+    std::istringstream broken("{\"velocity\": 30}\n{\"velocity\": \n7\n{\"velocity\": 40}\n");
+    std::vector<std::string> errors;
+    scenarios.clear();
+    read_scenarios(broken, true, [&scenarios](nlohmann::json scenario) {
+        scenarios.push_back(std::move(scenario));
+    }, [&errors](const std::string &error) {
+        errors.push_back(error);
+    });
+    REQUIRE(scenarios.size() == 2);
+    REQUIRE(errors.size() == 2);
+    REQUIRE(scenarios[1]["velocity"] == 40);
+    broken.clear();
+    broken.seekg(0);
+    REQUIRE_THROWS(read_scenarios(broken, true, [](nlohmann::json) {}));
+
+    std::istringstream array(R"([{"velocity": 30}, {"velocity": 40}])");
+    scenarios.clear();
+    read_scenarios(array, false, [&scenarios](nlohmann::json scenario) {
+        scenarios.push_back(std::move(scenario));
+    });
+    REQUIRE(scenarios.size() == 2);
+    REQUIRE(scenarios[1]["velocity"] == 40);
+}
+
+TEST_CASE("Pipeline writes results in input order", "[run_pipeline]") {
+    std::string lines = "{\"defaults\": {\"mass\": 0.05}}\n";
+    for(int i = 0; i < 2000; i++) {
+        lines += "{\"velocity\": " + std::to_string(i) + "}\n";
+    }
+    std::istringstream in(lines);
+    std::ostringstream out;
+    output_buffer buffer = create_output_buffer(out);
+    size_t count = run_pipeline(in, true, buffer, [](nlohmann::json scenario, size_t index) {
+        // uneven solve times let later scenarios finish first
+        if(index % 7 == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        return nlohmann::json{{"index", index}, {"velocity", scenario["velocity"]}, {"mass", scenario["mass"]}};
+    }, 4);
+    REQUIRE(count == 2000);
+
+    std::istringstream results(out.str());
+    std::string line;
+    size_t index = 0;
+    while(std::getline(results, line)) {
+        auto result = nlohmann::json::parse(line);
+        REQUIRE(result["index"] == index);
+        REQUIRE(result["velocity"] == index);
+        REQUIRE(result["mass"] == 0.05);
+        index++;
+    }
+    REQUIRE(index == 2000);
+
+    // a broken line becomes an error result without stopping the pipeline
+    std::istringstream broken("{\"velocity\": 1}\n{\"velocity\"\n{\"velocity\": 3}\n");
+    std::ostringstream broken_out;
+    output_buffer broken_buffer = create_output_buffer(broken_out);
+    count = run_pipeline(broken, true, broken_buffer, [](nlohmann::json scenario, size_t index) {
+        return nlohmann::json{{"index", index}, {"velocity", scenario["velocity"]}};
+    }, 2);
+    REQUIRE(count == 3);
+    std::istringstream broken_results(broken_out.str());
+    std::vector<nlohmann::json> parsed;
+    while(std::getline(broken_results, line)) {
+        parsed.push_back(nlohmann::json::parse(line));
+    }
+    REQUIRE(parsed.size() == 3);
+    REQUIRE(parsed[1].contains("error"));
+    REQUIRE(parsed[1]["index"] == 1);
+    REQUIRE(parsed[2]["velocity"] == 3);
+
+    // output precision of the defaults or of a scenario applies to its result
+    std::istringstream precise("{\"defaults\": {\"output_precision\": 3}}\n{\"angle\": 25.231678}\n{\"angle\": 25.231678, \"output_precision\": 5}\n");
+    std::ostringstream precise_out;
+    output_buffer precise_buffer = create_output_buffer(precise_out);
+    run_pipeline(precise, true, precise_buffer, [](nlohmann::json scenario, size_t) {
+        return nlohmann::json{{"angle", scenario["angle"].get<float>()}};
+    }, 2);
+    REQUIRE(precise_out.str() == "{\"angle\":25.2}\n{\"angle\":25.232}\n");
+}
+
+TEST_CASE("Buffered output formats numbers with to_chars", "[write_json]") {
+    std::ostringstream out;
+    output_buffer buffer = create_output_buffer(out, -1, 64);
+    nlohmann::json value = {{"angle", 25.231678f}, {"count", 3}, {"name", "a\"b"}, {"whole", 2.0f}, {"empty", nlohmann::json::array()}, {"precise", 0.1}};
+    write_json(buffer, value);
+    flush_buffer(buffer);
+    REQUIRE(out.str() == R"({"angle":25.231678,"count":3,"empty":[],"name":"a\"b","precise":0.1,"whole":2.0})");
+    // floats read back to the same value
+    REQUIRE(nlohmann::json::parse(out.str())["angle"].get<float>() == 25.231678f);
+
+    // indented layout is the one of nlohmann::json::dump
+    std::ostringstream indented;
+    output_buffer indented_buffer = create_output_buffer(indented);
+    nlohmann::json nested = {{"a", {1, 2}}, {"b", {{"c", true}}}};
+    write_json(indented_buffer, nested, 4);
+    flush_buffer(indented_buffer);
+    REQUIRE(indented.str() == nested.dump(4));
+
+    std::ostringstream csv;
+    output_buffer csv_buffer = create_output_buffer(csv, 3);
+    write_csv_row(csv_buffer, 1.23456f, 2, 1e-7f);
+    flush_buffer(csv_buffer);
+    REQUIRE(csv.str() == "1.23,2,1e-07\n");
+
+    // numbers longer than MAX_NUMBER_LENGTH are an error instead of garbage
+    std::ostringstream wide;
+    output_buffer wide_buffer = create_output_buffer(wide, 100);
+    REQUIRE_THROWS_AS(write_number(wide_buffer, 1e-300), std::runtime_error);
+    REQUIRE(wide_buffer.used == 0);
+}
+
+TEST_CASE("Asynchronous writer keeps bytes in order", "[async_writer]") {
+    std::string expected;
+    for(int i = 0; expected.size() < 3*ASYNC_BUFFER_SIZE + 1000; i++) {
+        expected += std::to_string(i) + (i % 13 == 0 ? "\n" : ",");
+    }
+    auto path = (std::filesystem::temp_directory_path() / "async_writer_test.txt").string();
+
+    // io_uring where the kernel allows it, and the writer thread
+    for(bool use_uring : {true, false}) {
+        async_writer writer;
+        REQUIRE(open_async_writer(writer, path, use_uring));
+        output_buffer buffer = create_output_buffer(writer, -1, 100000);
+        for(size_t i = 0; i < expected.size(); i += 777) {
+            write_text(buffer, std::string_view(expected).substr(i, 777));
+        }
+        flush_buffer(buffer);
+        REQUIRE(close_async_writer(writer));
+
+        std::ifstream in(path, std::ios::binary);
+        std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        REQUIRE(written == expected);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Trajectories are encoded as varint deltas", "[encode_curve]") {
+    std::vector<position> history;
+    simulate({0, 0, 0}, {0, 50, 100}, 0.001f, 1, {0, 20, 40}, &history);
+    REQUIRE(history.size() > 1000);
+
+    for(int order : {1, 2}) {
+        encoded_curve curve = encode_curve(history, DEFAULT_CURVE_RESOLUTION, order);
+        std::vector<position> decoded = decode_curve(curve);
+        REQUIRE(decoded.size() == history.size());
+        for(size_t i = 0; i < history.size(); i++) {
+            float error = std::max({std::abs(decoded[i].x - history[i].x), std::abs(decoded[i].y - history[i].y), std::abs(decoded[i].z - history[i].z)});
+            REQUIRE(error <= DEFAULT_CURVE_RESOLUTION);
+        }
+        if(order == 2) {
+            // 12 bytes of a point as floats
+            REQUIRE(curve.data.size()*10 < history.size()*sizeof(position));
+        }
+    }
+
+    std::stringstream file;
+    write_encoded_curves(file, {encode_curve(history), encode_curve({{-1, -2, -3}}, 0.5f, 1)});
+    auto curves = read_encoded_curves(file);
+    REQUIRE(curves.size() == 2);
+    REQUIRE(decode_curve(curves[0]).size() == history.size());
+    auto single = decode_curve(curves[1]);
+    REQUIRE(single.size() == 1);
+    REQUIRE(single[0].x == -1);
+    REQUIRE(single[0].z == -3);
+
+    REQUIRE_THROWS_AS(encode_curve(history, 0.0f), std::runtime_error);
+    REQUIRE_THROWS_AS(encode_curve(history, DEFAULT_CURVE_RESOLUTION, 3), std::runtime_error);
+}
+
+TEST_CASE("Curves beyond the memory budget are spilled to disk", "[trajectory_store]") {
+    std::vector<std::vector<position>> curves;
+    for(int i = 0; i < 200; i++) {
+        std::vector<position> curve;
+        for(int j = 0; j < 500 + i; j++) {
+            curve.push_back({0.01f*j, 0.5f*i - 0.001f*j*j, 0.02f*j});
+        }
+        curves.push_back(std::move(curve));
+    }
+
+    trajectory_store store(4096);
+    for(const auto &curve : curves) {
+        add_curve(store, encode_curve(curve));
+        REQUIRE(store.resident_bytes <= store.budget);
+    }
+    REQUIRE(store.first_resident > 0);
+    REQUIRE(store.used > 0);
+
+    // random access to spilled and resident curves
+    for(size_t i : {199, 0, 57, 198}) {
+        auto decoded = decode_curve(get_curve(store, i));
+        REQUIRE(decoded.size() == curves[i].size());
+        REQUIRE(std::abs(decoded.back().y - curves[i].back().y) <= DEFAULT_CURVE_RESOLUTION);
+    }
+
+    std::stringstream file;
+    write_stored_curves(file, store);
+    auto read = read_encoded_curves(file);
+    REQUIRE(read.size() == curves.size());
+    REQUIRE(decode_curve(read[100]).size() == curves[100].size());
+    close_trajectory_store(store);
+
+    // the solver hands over trajectories as soon as they are complete
+    solver_options options = get_default_options({0, 0, 0}, {0, 0, 50}, 0.01f);
+    std::vector<std::vector<position>> solver_curves;
+    size_t sunk = 0;
+    options.curves = &solver_curves;
+    options.curve_sink = [&sunk](std::vector<position> &&curve) {
+        REQUIRE(!curve.empty());
+        sunk++;
+    };
+    auto solutions = solve_firing_solutions({0, 0, 0}, {0, 0, 50}, 30, 0.05f, options);
+    REQUIRE(solver_curves.empty());
+    REQUIRE(sunk == static_cast<size_t>(solutions[0].shots + solutions[1].shots));
+}
+
+TEST_CASE("The temporary directory is only needed once curves are spilled", "[trajectory_store]") {
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string previous = tmpdir != nullptr ? tmpdir : "";
+    setenv("TMPDIR", "/nonexistent", 1);
+
+    std::vector<position> curve = {{0, 0, 0}, {1, 1, 1}};
+    {
+        trajectory_store store(4096);
+        add_curve(store, encode_curve(curve));
+        REQUIRE(store.fd < 0);
+    }
+    {
+        trajectory_store store(0);
+        REQUIRE_THROWS_AS(add_curve(store, encode_curve(curve)), std::runtime_error);
+    }
+
+    if(tmpdir != nullptr) {
+        setenv("TMPDIR", previous.c_str(), 1);
+    }
+    else {
+        unsetenv("TMPDIR");
+    }
+}
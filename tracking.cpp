@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "simulation.cpp"
+
+const int MAX_TRACKING_SHOTS = 4; // corrective shots of one update before solving from scratch
+
+/// @brief Firing solution kept up to date while the target moves
+struct tracker {
+    position start;
+    float velocity_init;
+    float mass;
+    trajectory_arc arc;
+    float tolerance; // accepted distance from the target in meters
+    solver_options options;
+    firing_solution solution; // last converged solution
+    bool converged;
+    float range; // horizontal distance of the target of the last converged solution
+    float offset_per_range; // change of the aim offset above the target per meter of range
+    bool has_sensitivity;
+};
+
+/// @brief Result of one tracker update
+struct tracking_update {
+    velocity vel; // launch velocity of the verified shot
+    float min_distance;
+    int shots; // simulations run for the update
+    bool cold; // solved from scratch
+};
+
+
+/// @brief Create tracker, the first update solves from scratch
+/// @param start starting position
+/// @param velocity_init initial velocity of the bullet
+/// @param bullet_mass mass of the bullet
+/// @param options settings of the solver used for the cold solve, the last stage sets the time step of updates
+/// @param arc trajectory arc to track
+/// @param tolerance accepted distance from the target in meters
+/// @return tracker
+tracker create_tracker(position start, float velocity_init, float bullet_mass, const solver_options &options, trajectory_arc arc = trajectory_arc::direct, float tolerance = 0.05f) {
+    tracker t{};
+    t.start = start;
+    t.velocity_init = velocity_init;
+    t.mass = bullet_mass;
+    t.arc = arc;
+    t.tolerance = tolerance;
+    t.options = options;
+    t.options.curves = nullptr;
+    return t;
+}
+
+
+/// @brief Aim offset above the target of the last solution
+/// @param t tracker
+/// @return offset in meters
+float get_aim_offset(const tracker &t) {
+    return t.solution.aim.y - t.solution.target.y;
+}
+
+
+/// @brief Solve for the new target position, starting from the last solution moved by the target delta
+/// In the steady state the prediction is verified by a single simulation.
+/// @param t tracker
+/// @param target new target position
+/// @return launch of the verified shot
+tracking_update update_tracker(tracker &t, position target) {
+    simulation_limits limits = t.options.limits;
+    limits.floor = std::min(limits.floor, target.y);
+
+    if(t.converged) {
+        // predict aim offset from the change of range, then move aim and secant with the target
+        float range = get_horizontal_distance(t.start, target);
+        float previous_offset = get_aim_offset(t);
+        float offset = previous_offset;
+        if(t.has_sensitivity) {
+            offset += t.offset_per_range*(range - t.range);
+        }
+        move_target(t.solution, t.start, target, t.velocity_init);
+        t.solution.aim.y = target.y + offset;
+
+        float dt = t.options.stages.back().dt;
+        for(int i = 0; i < MAX_TRACKING_SHOTS; i++) {
+            velocity vel = aim_with_gravity(t.start, t.solution.aim, t.velocity_init, t.arc);
+            auto results = simulate_batch({{t.start, t.solution.aim, vel, t.mass, nullptr, nullptr, 0.0f, t.options.drag, t.options.compensated}}, dt, limits, t.options.env);
+            correct_aim(t.solution, t.start, target, t.velocity_init, results[0]);
+            t.solution.vel = vel;
+            if(t.solution.min_distance <= t.tolerance) {
+                // secant of the aim offset over the range of the last two updates
+                if(std::abs(range - t.range) > 1e-3f) {
+                    t.offset_per_range = (get_aim_offset(t) - previous_offset)/(range - t.range);
+                    t.has_sensitivity = true;
+                }
+                t.range = range;
+                return {vel, t.solution.min_distance, i + 1, false};
+            }
+        }
+    }
+
+    // first update or the prediction did not converge
+    solver_options options = t.options;
+    options.limits = limits;
+    options.motion = nullptr;
+    int shots = 0;
+    for(const auto &stage : options.stages) {
+        shots += stage.shots;
+    }
+    for(auto &solution : solve_firing_solutions(t.start, target, t.velocity_init, t.mass, options)) {
+        if(solution.arc == t.arc) {
+            t.solution = solution;
+        }
+    }
+    t.converged = t.solution.min_distance <= t.tolerance;
+    t.range = get_horizontal_distance(t.start, target);
+    t.has_sensitivity = false;
+    return {t.solution.vel, t.solution.min_distance, shots, true};
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <cstring>
+#include <stdexcept>
+
+#include "simulation.cpp"
+
+const char TRAJECTORY_FILE_MAGIC[4] = {'T', 'R', 'A', 'J'};
+const float DEFAULT_CURVE_RESOLUTION = 1e-4f; // m, quantization step of encoded curves
+const int MAX_VARINT_LENGTH = 10; // bytes of the longest 64-bit varint
+const uint8_t ESCAPED_POINT = 0x80; // marks a point stored as varints instead of a packed byte
+
+/// @brief Curve quantized to a resolution and stored as zigzag varint deltas
+/// The first point is stored as is, every other point as its difference to the previous one or, for second order,
+/// as the change of that difference, which is tiny on smooth trajectories sampled at a constant time step.
+/// A point whose three values are within -2 and 1 takes a single byte of 2 bits per coordinate, any other point
+/// is the escape byte ESCAPED_POINT followed by three zigzag varints.
+struct encoded_curve {
+    float resolution = DEFAULT_CURVE_RESOLUTION;
+    uint8_t order = 2; // 1 stores deltas, 2 deltas of deltas
+    uint32_t count = 0; // number of points
+    std::vector<uint8_t> data;
+};
+
+/// @brief State of a curve being encoded point by point
+struct curve_encoder {
+    encoded_curve curve;
+    int64_t last[3] = {0, 0, 0};
+    int64_t last_delta[3] = {0, 0, 0};
+};
+
+
+/// @brief Map signed integer to unsigned, small magnitudes of both signs become small numbers
+/// @param value signed value
+/// @return zigzag value
+inline uint64_t zigzag_encode(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+
+/// @brief Inverse of zigzag_encode
+/// @param zigzag zigzag value
+/// @return signed value
+inline int64_t zigzag_decode(uint64_t zigzag) {
+    return static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+}
+
+
+/// @brief Append unsigned integer as varint, 7 bits per byte
+/// @param data bytes to append to
+/// @param value value to append
+inline void write_varint(std::vector<uint8_t> &data, uint64_t value) {
+    while(value >= 0x80) {
+        data.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    data.push_back(static_cast<uint8_t>(value));
+}
+
+
+/// @brief Read varint
+/// @param data position of the varint, moved past it
+/// @param end end of the data
+/// @return value
+inline uint64_t read_varint(const uint8_t *&data, const uint8_t *end) {
+    uint64_t value = 0;
+    for(int shift = 0; shift < 7*MAX_VARINT_LENGTH; shift += 7) {
+        if(data == end) {
+            break;
+        }
+        uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("encoded curve is truncated");
+}
+
+
+/// @brief Check settings of the encoding
+/// @param resolution quantization step, positive
+/// @param order 1 or 2
+/// @throws std::runtime_error for other values
+void check_curve_encoding(float resolution, int order) {
+    if(!(resolution > 0)) {
+        throw std::runtime_error("curve resolution has to be positive");
+    }
+    if(order != 1 && order != 2) {
+        throw std::runtime_error("curve delta order has to be 1 or 2");
+    }
+}
+
+
+/// @brief Create encoder for a curve
+/// @param resolution quantization step, points are decoded within half of it
+/// @param order 1 for deltas, 2 for deltas of deltas
+/// @return encoder
+/// @throws std::runtime_error for a resolution that is not positive or another order
+curve_encoder create_curve_encoder(float resolution = DEFAULT_CURVE_RESOLUTION, int order = 2) {
+    check_curve_encoding(resolution, order);
+    curve_encoder encoder;
+    encoder.curve.resolution = resolution;
+    encoder.curve.order = static_cast<uint8_t>(order);
+    return encoder;
+}
+
+
+/// @brief Append point to an encoded curve
+/// @param encoder encoder of the curve
+/// @param pos point to append
+inline void append_point(curve_encoder &encoder, position pos) {
+    const double scale = 1.0/encoder.curve.resolution;
+    const float coordinates[3] = {pos.x, pos.y, pos.z};
+    uint64_t values[3];
+    for(int a = 0; a < 3; a++) {
+        int64_t quantized = std::llround(coordinates[a]*scale);
+        int64_t delta = quantized - encoder.last[a];
+        values[a] = zigzag_encode(encoder.curve.order == 2 ? delta - encoder.last_delta[a] : delta);
+        // the first point is not a step, the delta of the second point is written in full
+        encoder.last_delta[a] = encoder.curve.count > 0 ? delta : 0;
+        encoder.last[a] = quantized;
+    }
+    if(values[0] < 4 && values[1] < 4 && values[2] < 4) {
+        encoder.curve.data.push_back(static_cast<uint8_t>(values[0] | values[1] << 2 | values[2] << 4));
+    }
+    else {
+        encoder.curve.data.push_back(ESCAPED_POINT);
+        for(auto value : values) {
+            write_varint(encoder.curve.data, value);
+        }
+    }
+    encoder.curve.count++;
+}
+
+
+/// @brief Encode curve
+/// @param curve points of the curve
+/// @param resolution quantization step, points are decoded within half of it
+/// @param order 1 for deltas, 2 for deltas of deltas
+/// @return encoded curve
+encoded_curve encode_curve(const std::vector<position> &curve, float resolution = DEFAULT_CURVE_RESOLUTION, int order = 2) {
+    curve_encoder encoder = create_curve_encoder(resolution, order);
+    for(const auto &pos : curve) {
+        append_point(encoder, pos);
+    }
+    return std::move(encoder.curve);
+}
+
+
+/// @brief Decode curve
+/// @param curve encoded curve
+/// @return points of the curve
+std::vector<position> decode_curve(const encoded_curve &curve) {
+    std::vector<position> points(curve.count);
+    const uint8_t *data = curve.data.data();
+    const uint8_t *end = data + curve.data.size();
+    const double resolution = curve.resolution;
+    int64_t last[3] = {0, 0, 0};
+    int64_t last_delta[3] = {0, 0, 0};
+    for(uint32_t i = 0; i < curve.count; i++) {
+        if(data == end) {
+            throw std::runtime_error("encoded curve is truncated");
+        }
+        uint8_t packed = *data++;
+        double coordinates[3];
+        for(int a = 0; a < 3; a++) {
+            uint64_t value = packed == ESCAPED_POINT ? read_varint(data, end) : packed >> 2*a & 3;
+            int64_t delta = curve.order == 2 ? last_delta[a] + zigzag_decode(value) : zigzag_decode(value);
+            last_delta[a] = i > 0 ? delta : 0;
+            last[a] += delta;
+            coordinates[a] = last[a]*resolution;
+        }
+        points[i] = {static_cast<float>(coordinates[0]), static_cast<float>(coordinates[1]), static_cast<float>(coordinates[2])};
+    }
+    return points;
+}
+
+
+/// @brief Write encoded curves in the binary trajectory format
+/// The format is the magic "TRAJ" and the number of curves, then per curve its resolution, order, number of points,
+/// number of bytes and the bytes, all in native byte order.
+/// @param out binary stream
+/// @param curves encoded curves
+void write_encoded_curves(std::ostream &out, const std::vector<encoded_curve> &curves) {
+    uint32_t count = static_cast<uint32_t>(curves.size());
+    out.write(TRAJECTORY_FILE_MAGIC, sizeof(TRAJECTORY_FILE_MAGIC));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for(const auto &curve : curves) {
+        uint64_t size = curve.data.size();
+        out.write(reinterpret_cast<const char *>(&curve.resolution), sizeof(curve.resolution));
+        out.write(reinterpret_cast<const char *>(&curve.order), sizeof(curve.order));
+        out.write(reinterpret_cast<const char *>(&curve.count), sizeof(curve.count));
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        out.write(reinterpret_cast<const char *>(curve.data.data()), size);
+    }
+}
+
+
+/// @brief Read encoded curves written by write_encoded_curves
+/// @param in binary stream
+/// @return encoded curves
+std::vector<encoded_curve> read_encoded_curves(std::istream &in) {
+    char magic[4];
+    uint32_t count;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if(!in || std::memcmp(magic, TRAJECTORY_FILE_MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error("not a trajectory file");
+    }
+    std::vector<encoded_curve> curves(count);
+    for(auto &curve : curves) {
+        uint64_t size;
+        in.read(reinterpret_cast<char *>(&curve.resolution), sizeof(curve.resolution));
+        in.read(reinterpret_cast<char *>(&curve.order), sizeof(curve.order));
+        in.read(reinterpret_cast<char *>(&curve.count), sizeof(curve.count));
+        in.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if(!in) {
+            throw std::runtime_error("trajectory file is truncated");
+        }
+        curve.data.resize(size);
+        in.read(reinterpret_cast<char *>(curve.data.data()), size);
+    }
+    if(!in) {
+        throw std::runtime_error("trajectory file is truncated");
+    }
+    return curves;
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdexcept>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trajectory_codec.cpp"
+
+const size_t DEFAULT_HISTORY_BUDGET = 64 << 20; // bytes of encoded curves kept in memory before they are spilled
+const size_t SPILL_FILE_GROWTH = 64 << 20; // smallest growth of the spill file
+
+/// @brief Encoded curve kept in memory or in the spill file
+struct stored_curve {
+    float resolution;
+    uint8_t order;
+    uint32_t count; // number of points
+    uint64_t size; // number of bytes
+    uint64_t offset; // position in the spill file, valid once spilled
+    std::vector<uint8_t> data; // bytes while in memory, empty once spilled
+};
+
+struct trajectory_store;
+void close_trajectory_store(trajectory_store &store);
+
+/// @brief Completed curves indexed in order of arrival, spilled to an append-only memory mapped file
+/// once the curves in memory exceed a budget, so memory stays bounded for any number of curves
+/// The store owns the spill file and its mapping, it releases them when destroyed and cannot be copied.
+struct trajectory_store {
+    size_t budget = DEFAULT_HISTORY_BUDGET;
+    size_t resident_bytes = 0; // bytes of curves in memory
+    size_t first_resident = 0; // curves before it are spilled
+    std::vector<stored_curve> index;
+    std::string directory; // where the spill file is created, the temporary directory when empty
+    int fd = -1; // spill file, unlinked as soon as it is created
+    char *map = nullptr;
+    size_t capacity = 0; // mapped bytes of the spill file
+    size_t used = 0; // written bytes of the spill file
+
+    /// @param budget bytes of encoded curves kept in memory
+    /// @param directory where the spill file is created, the temporary directory when empty
+    explicit trajectory_store(size_t budget = DEFAULT_HISTORY_BUDGET, const std::string &directory = "")
+        : budget(budget), directory(directory) {}
+    trajectory_store(const trajectory_store &) = delete;
+    trajectory_store &operator=(const trajectory_store &) = delete;
+    ~trajectory_store() {
+        close_trajectory_store(*this);
+    }
+};
+
+
+/// @brief Grow the spill file and its mapping to hold more bytes, creating the file on first use
+/// The temporary directory is only looked up when the file is created, so stores that never spill do not need one.
+/// @param store store of curves
+/// @param size bytes to append
+/// @throws std::runtime_error when the file cannot be created, grown or mapped
+void reserve_spill(trajectory_store &store, size_t size) {
+    if(store.used + size <= store.capacity) {
+        return;
+    }
+    if(store.fd < 0) {
+        if(store.directory.empty()) {
+            std::error_code error;
+            store.directory = std::filesystem::temp_directory_path(error).string();
+            if(error) {
+                throw std::runtime_error("no temporary directory for the spill file, set spill_directory: " + error.message());
+            }
+        }
+        std::string path = store.directory + "/trajectories-XXXXXX";
+        store.fd = mkstemp(path.data());
+        if(store.fd < 0) {
+            throw std::runtime_error("cannot create spill file in " + store.directory);
+        }
+        unlink(path.c_str());
+    }
+    size_t capacity = std::max({store.capacity*2, store.used + size, SPILL_FILE_GROWTH});
+    if(ftruncate(store.fd, capacity) != 0) {
+        throw std::runtime_error("cannot grow spill file");
+    }
+    if(store.map != nullptr) {
+        munmap(store.map, store.capacity);
+    }
+    void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, store.fd, 0);
+    if(map == MAP_FAILED) {
+        store.map = nullptr;
+        throw std::runtime_error("cannot map spill file");
+    }
+    store.map = static_cast<char *>(map);
+    store.capacity = capacity;
+}
+
+
+/// @brief Append all curves in memory to the spill file and release their memory
+/// Written pages are dropped from the mapping, they stay in the page cache and do not count to the memory of the process.
+/// @param store store of curves
+void spill_curves(trajectory_store &store) {
+    reserve_spill(store, store.resident_bytes);
+    size_t first = store.used;
+    for(size_t i = store.first_resident; i < store.index.size(); i++) {
+        auto &curve = store.index[i];
+        std::memcpy(store.map + store.used, curve.data.data(), curve.size);
+        curve.offset = store.used;
+        store.used += curve.size;
+        std::vector<uint8_t>().swap(curve.data);
+    }
+    store.first_resident = store.index.size();
+    store.resident_bytes = 0;
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = first/page*page;
+    madvise(store.map + begin, store.used - begin, MADV_DONTNEED);
+}
+
+
+/// @brief Add completed curve, spilling the curves in memory when they exceed the budget
+/// @param store store of curves
+/// @param curve encoded curve
+/// @return index of the curve
+size_t add_curve(trajectory_store &store, encoded_curve &&curve) {
+    uint64_t size = curve.data.size();
+    store.index.push_back({curve.resolution, curve.order, curve.count, size, 0, std::move(curve.data)});
+    store.resident_bytes += size;
+    if(store.resident_bytes > store.budget) {
+        spill_curves(store);
+    }
+    return store.index.size() - 1;
+}
+
+
+/// @brief Encoded curve from memory or from the spill file
+/// @param store store of curves
+/// @param i index of the curve
+/// @return encoded curve
+encoded_curve get_curve(const trajectory_store &store, size_t i) {
+    const auto &stored = store.index[i];
+    encoded_curve curve{stored.resolution, stored.order, stored.count, {}};
+    if(i < store.first_resident) {
+        const auto *first = reinterpret_cast<const uint8_t *>(store.map + stored.offset);
+        curve.data.assign(first, first + stored.size);
+    }
+    else {
+        curve.data = stored.data;
+    }
+    return curve;
+}
+
+
+/// @brief Write all curves in the binary trajectory format of write_encoded_curves, one curve at a time
+/// @param out binary stream
+/// @param store store of curves
+void write_stored_curves(std::ostream &out, const trajectory_store &store) {
+    uint32_t count = static_cast<uint32_t>(store.index.size());
+    out.write(TRAJECTORY_FILE_MAGIC, sizeof(TRAJECTORY_FILE_MAGIC));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for(size_t i = 0; i < store.index.size(); i++) {
+        const auto &curve = store.index[i];
+        const char *data = i < store.first_resident ? store.map + curve.offset : reinterpret_cast<const char *>(curve.data.data());
+        out.write(reinterpret_cast<const char *>(&curve.resolution), sizeof(curve.resolution));
+        out.write(reinterpret_cast<const char *>(&curve.order), sizeof(curve.order));
+        out.write(reinterpret_cast<const char *>(&curve.count), sizeof(curve.count));
+        out.write(reinterpret_cast<const char *>(&curve.size), sizeof(curve.size));
+        out.write(data, curve.size);
+    }
+}
+
+
+/// @brief Release memory and the spill file of the store
+/// @param store store of curves
+void close_trajectory_store(trajectory_store &store) {
+    if(store.map != nullptr) {
+        munmap(store.map, store.capacity);
+        store.map = nullptr;
+    }
+    if(store.fd >= 0) {
+        close(store.fd);
+        store.fd = -1;
+    }
+    store.index.clear();
+    store.capacity = store.used = store.resident_bytes = store.first_resident = 0;
+}
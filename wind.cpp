@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+const int WIND_BRICK_SIZE = 4; // cells along each axis of a brick
+const int WIND_BRICK_NODES = WIND_BRICK_SIZE + 1; // nodes along each axis of a brick, neighbouring bricks share a layer
+const char WIND_FILE_MAGIC[4] = {'W', 'I', 'N', 'D'};
+const uint32_t MAX_WIND_NODES = 1 << 16; // most nodes along an axis of a wind field file
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull; // hash of no bytes
+
+/// @brief Wind vector at a grid node
+struct wind_vector {
+    float u;
+    float v;
+    float w;
+};
+
+/// @brief Wind on a regular 3D grid stored in bricks of 4x4x4 cells
+/// Every brick stores all 5x5x5 nodes of its cells, so the 8 corners of any cell are in one
+/// contiguous block of 1.5 kB and bullets close to each other hit the same cache lines.
+struct wind_field {
+    float origin[3];
+    float spacing[3];
+    int nodes[3]; // number of nodes along each axis
+    int bricks[3]; // number of bricks along each axis
+    std::vector<wind_vector> data;
+    uint64_t hash; // hash of the grid, computed once when the field is created
+};
+
+
+/// @brief Add bytes to an FNV-1a hash
+/// @param hash hash so far
+/// @param data bytes to add
+/// @param size number of bytes
+/// @return hash including the bytes
+inline uint64_t add_to_hash(uint64_t hash, const void *data, size_t size) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i])*1099511628211ull;
+    }
+    return hash;
+}
+
+
+/// @brief Build a wind field from nodes in x fastest order
+/// @param nx number of nodes along x
+/// @param ny number of nodes along y
+/// @param nz number of nodes along z
+/// @param origin position of the first node
+/// @param spacing distance of nodes along each axis
+/// @param linear wind vectors, index is x + nx*(y + ny*z)
+/// @return wind field in bricked layout
+/// @throws std::runtime_error for less than 2 nodes along an axis, a missing vector or a spacing that is not positive
+wind_field create_wind_field(int nx, int ny, int nz, const float origin[3], const float spacing[3], const std::vector<wind_vector> &linear) {
+    if(nx < 2 || ny < 2 || nz < 2 || linear.size() != static_cast<size_t>(nx)*ny*nz) {
+        throw std::runtime_error("wind field needs at least 2 nodes along each axis and a vector for every node");
+    }
+    for(int a = 0; a < 3; a++) {
+        if(!(spacing[a] > 0) || !std::isfinite(spacing[a])) {
+            throw std::runtime_error("wind field spacing has to be positive and finite");
+        }
+    }
+    wind_field field{};
+    int n[3] = {nx, ny, nz};
+    for(int a = 0; a < 3; a++) {
+        field.origin[a] = origin[a];
+        field.spacing[a] = spacing[a];
+        field.nodes[a] = n[a];
+        field.bricks[a] = (n[a] - 2)/WIND_BRICK_SIZE + 1;
+    }
+    const int brick_volume = WIND_BRICK_NODES*WIND_BRICK_NODES*WIND_BRICK_NODES;
+    field.data.resize(static_cast<size_t>(field.bricks[0])*field.bricks[1]*field.bricks[2]*brick_volume);
+
+    for(int bz = 0; bz < field.bricks[2]; bz++) {
+        for(int by = 0; by < field.bricks[1]; by++) {
+            for(int bx = 0; bx < field.bricks[0]; bx++) {
+                size_t brick = (static_cast<size_t>(bz)*field.bricks[1] + by)*field.bricks[0] + bx;
+                for(int lz = 0; lz < WIND_BRICK_NODES; lz++) {
+                    for(int ly = 0; ly < WIND_BRICK_NODES; ly++) {
+                        for(int lx = 0; lx < WIND_BRICK_NODES; lx++) {
+                            // nodes past the end of the grid repeat the last one
+                            int x = std::min(bx*WIND_BRICK_SIZE + lx, nx - 1);
+                            int y = std::min(by*WIND_BRICK_SIZE + ly, ny - 1);
+                            int z = std::min(bz*WIND_BRICK_SIZE + lz, nz - 1);
+                            size_t local = (lz*WIND_BRICK_NODES + ly)*WIND_BRICK_NODES + lx;
+                            field.data[brick*brick_volume + local] = linear[(static_cast<size_t>(z)*ny + y)*nx + x];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    field.hash = add_to_hash(FNV_OFFSET_BASIS, field.origin, sizeof(field.origin));
+    field.hash = add_to_hash(field.hash, field.spacing, sizeof(field.spacing));
+    field.hash = add_to_hash(field.hash, field.nodes, sizeof(field.nodes));
+    field.hash = add_to_hash(field.hash, field.data.data(), field.data.size()*sizeof(wind_vector));
+    return field;
+}
+
+
+/// @brief Load wind field from a binary file
+/// File contains "WIND", three uint32 node counts, three float origin coordinates,
+/// three float spacings and three floats (u, v, w) for every node in x fastest order.
+/// @param path path to the file
+/// @return wind field in bricked layout
+/// @throws std::runtime_error when the node counts are out of range or do not match the size of the file
+wind_field load_wind_field(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    char magic[4];
+    uint32_t n[3];
+    float origin[3];
+    float spacing[3];
+    f.read(magic, sizeof(magic));
+    f.read(reinterpret_cast<char *>(n), sizeof(n));
+    f.read(reinterpret_cast<char *>(origin), sizeof(origin));
+    f.read(reinterpret_cast<char *>(spacing), sizeof(spacing));
+    if(!f || std::memcmp(magic, WIND_FILE_MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error("not a wind field file: " + path);
+    }
+    for(auto count : n) {
+        if(count < 2 || count > MAX_WIND_NODES) {
+            throw std::runtime_error("wind field file needs 2 to " + std::to_string(MAX_WIND_NODES) + " nodes along each axis: " + path);
+        }
+    }
+    // the node counts are checked against the size of the file before the vectors are allocated
+    std::streamoff header = f.tellg();
+    f.seekg(0, std::ios::end);
+    std::streamoff size = f.tellg();
+    f.seekg(header);
+    size_t count = static_cast<size_t>(n[0])*n[1]*n[2];
+    if(!f || count > static_cast<size_t>(size - header)/sizeof(wind_vector)) {
+        throw std::runtime_error("wind field file is truncated: " + path);
+    }
+    std::vector<wind_vector> linear(count);
+    f.read(reinterpret_cast<char *>(linear.data()), linear.size()*sizeof(wind_vector));
+    if(!f) {
+        throw std::runtime_error("wind field file is truncated: " + path);
+    }
+    return create_wind_field(n[0], n[1], n[2], origin, spacing, linear);
+}
+
+
+/// @brief Save wind field to a binary file readable by load_wind_field
+/// @param path path to the file
+/// @param nx number of nodes along x
+/// @param ny number of nodes along y
+/// @param nz number of nodes along z
+/// @param origin position of the first node
+/// @param spacing distance of nodes along each axis
+/// @param linear wind vectors, index is x + nx*(y + ny*z)
+void save_wind_field(const std::string &path, int nx, int ny, int nz, const float origin[3], const float spacing[3], const std::vector<wind_vector> &linear) {
+    std::ofstream f(path, std::ios::binary);
+    uint32_t n[3] = {static_cast<uint32_t>(nx), static_cast<uint32_t>(ny), static_cast<uint32_t>(nz)};
+    f.write(WIND_FILE_MAGIC, sizeof(WIND_FILE_MAGIC));
+    f.write(reinterpret_cast<const char *>(n), sizeof(n));
+    f.write(reinterpret_cast<const char *>(origin), 3*sizeof(float));
+    f.write(reinterpret_cast<const char *>(spacing), 3*sizeof(float));
+    f.write(reinterpret_cast<const char *>(linear.data()), linear.size()*sizeof(wind_vector));
+}
+
+
+/// @brief Wind at a position, trilinear interpolation of the 8 nodes around it
+/// Positions outside of the grid take the wind of the closest boundary.
+/// @param field wind field
+/// @param x x coordinate
+/// @param y y coordinate
+/// @param z z coordinate
+/// @return wind vector
+inline wind_vector sample_wind(const wind_field &field, float x, float y, float z) {
+    float p[3] = {x, y, z};
+    int cell[3];
+    float fraction[3];
+    for(int a = 0; a < 3; a++) {
+        float index = std::clamp((p[a] - field.origin[a])/field.spacing[a], 0.0f, static_cast<float>(field.nodes[a] - 1));
+        cell[a] = std::min(static_cast<int>(index), field.nodes[a] - 2);
+        fraction[a] = index - cell[a];
+    }
+    const int brick_volume = WIND_BRICK_NODES*WIND_BRICK_NODES*WIND_BRICK_NODES;
+    size_t brick = (static_cast<size_t>(cell[2]/WIND_BRICK_SIZE)*field.bricks[1] + cell[1]/WIND_BRICK_SIZE)*field.bricks[0] + cell[0]/WIND_BRICK_SIZE;
+    const wind_vector *corner = field.data.data() + brick*brick_volume
+        + ((cell[2] % WIND_BRICK_SIZE)*WIND_BRICK_NODES + cell[1] % WIND_BRICK_SIZE)*WIND_BRICK_NODES + cell[0] % WIND_BRICK_SIZE;
+
+    // offsets of the neighbouring nodes inside the brick
+    const int dy = WIND_BRICK_NODES;
+    const int dz = WIND_BRICK_NODES*WIND_BRICK_NODES;
+    auto lerp = [](const wind_vector &a, const wind_vector &b, float f) {
+        return wind_vector{a.u + (b.u - a.u)*f, a.v + (b.v - a.v)*f, a.w + (b.w - a.w)*f};
+    };
+    wind_vector x00 = lerp(corner[0], corner[1], fraction[0]);
+    wind_vector x10 = lerp(corner[dy], corner[dy + 1], fraction[0]);
+    wind_vector x01 = lerp(corner[dz], corner[dz + 1], fraction[0]);
+    wind_vector x11 = lerp(corner[dz + dy], corner[dz + dy + 1], fraction[0]);
+    return lerp(lerp(x00, x10, fraction[1]), lerp(x01, x11, fraction[1]), fraction[2]);
+}